@@ -34,6 +34,8 @@
 #ifndef GC_H_
 #define GC_H_
 
+#include <chrono>
+
 #include "mpgc/gc_fwd.h"
 #include "mpgc/offset_ptr.h"
 #include "mpgc/gc_desc.h"
@@ -85,6 +87,19 @@ namespace mpgc {
   };
 
   class gc_mem_stats {
+  public:
+    /*
+     * Free chunks are counted in power-of-two size classes: class k holds
+     * the chunks of [1 << k, 2 << k) bytes.
+     */
+    static constexpr std::size_t n_free_size_classes = 64;
+    enum class sweep_phase : uint8_t {
+      sweep1,     //free chunks left over from the last cycle, grown over dead neighbours
+      sweep2,     //the mark bitmap and the weak pointers (includes lazy sweeping)
+      post_sweep, //clearing the bitmaps for the next cycle
+    };
+    static constexpr std::size_t n_sweep_phases = 3;
+  private:
     std::atomic<std::size_t> gc_cycle_num;
     offset_ptr<gc_control_block> cblk;
     const std::size_t heap_size;
@@ -92,13 +107,75 @@ namespace mpgc {
     std::atomic<std::size_t> in_use_current;
     std::atomic<std::size_t> n_objects_stable;
     std::atomic<std::size_t> n_objects_current;
+    /*
+     * Free space found by the sweep: the number of chunks it put on the
+     * global free lists and their total size.  The _stable values are
+     * those of the last sweep to finish (see sweep_finished()).
+     */
+    std::atomic<std::size_t> free_chunks_stable;
+    std::atomic<std::size_t> free_chunks_current;
+    std::atomic<std::size_t> free_bytes_stable;
+    std::atomic<std::size_t> free_bytes_current;
+    std::atomic<std::size_t> largest_free_stable;
+    std::atomic<std::size_t> largest_free_current;
+    std::atomic<std::size_t> free_size_class_stable[n_free_size_classes];
+    std::atomic<std::size_t> free_size_class_current[n_free_size_classes];
+    //Nodes in the skiplist the last sweep filled, and how long its phases took.
+    std::atomic<std::size_t> skiplist_nodes_stable;
+    std::atomic<std::int64_t> sweep_phase_ns[n_sweep_phases];
+    /*
+     * Handshake waits by the GC threads of all processes, since the heap
+     * was created: how many, how long they took and how much CPU the
+     * waiting GC thread used (see gc_handshake::wait_handshake()).
+     */
+    std::atomic<std::size_t> handshakes;
+    std::atomic<std::int64_t> handshake_wait_ns;
+    std::atomic<std::int64_t> handshake_cpu_ns;
+    std::atomic<std::int64_t> handshake_max_wait_ns;
+    /*
+     * Pacing state.  allocated_current counts the bytes handed out by
+     * the global free lists since the end of the last cycle.  A cycle
+     * is explicitly requested while gc_cycle_num < requested_cycle.
+     * Times are in steady_clock nanoseconds, which is shared by all
+     * processes on the machine.
+     */
+    std::atomic<std::size_t> allocated_current;
+    std::atomic<std::size_t> requested_cycle;
+    std::atomic<std::int64_t> cycle_start_ns;
+    std::atomic<std::int64_t> cycle_end_ns;
+    std::atomic<std::int64_t> cycle_duration_ns;
     friend class gc_control_block;
     gc_mem_stats(std::size_t hs, offset_ptr<gc_control_block> cb)
       : gc_cycle_num(0), cblk(cb), heap_size(hs),
 	in_use_stable(0), in_use_current(0),
-	n_objects_stable(0), n_objects_current(0)
-    {}
+	n_objects_stable(0), n_objects_current(0),
+	free_chunks_stable(0), free_chunks_current(0),
+	free_bytes_stable(0), free_bytes_current(0),
+	largest_free_stable(0), largest_free_current(0),
+	skiplist_nodes_stable(0),
+	handshakes(0), handshake_wait_ns(0), handshake_cpu_ns(0), handshake_max_wait_ns(0),
+	allocated_current(0), requested_cycle(0),
+	cycle_start_ns(now_ns()), cycle_end_ns(now_ns()), cycle_duration_ns(0)
+    {
+      for (std::size_t k = 0; k < n_free_size_classes; k++) {
+        free_size_class_stable[k] = 0;
+        free_size_class_current[k] = 0;
+      }
+      for (std::size_t i = 0; i < n_sweep_phases; i++) {
+        sweep_phase_ns[i] = 0;
+      }
+    }
+    /*
+     * Adds the counts the processes' threads have flushed (see
+     * mark_counter) since the last call into in_use_current and
+     * n_objects_current.
+     */
+    void fold_process_counts();
   public:
+    static std::int64_t now_ns() {
+      using namespace std::chrono;
+      return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+    }
     std::size_t bytes_in_heap() const {
       return heap_size;
     }
@@ -111,6 +188,9 @@ namespace mpgc {
     std::size_t bytes_free() const {
       return bytes_in_heap()-bytes_in_use();
     }
+    std::size_t bytes_allocated_since_cycle() const {
+      return allocated_current;
+    }
     std::size_t cycle_number() const {
       return gc_cycle_num;
     }
@@ -123,25 +203,159 @@ namespace mpgc {
     std::size_t n_current_objects() const {
       return n_objects_current;
     }
+    std::size_t free_chunks_after_sweep() const {
+      return free_chunks_stable;
+    }
+    std::size_t free_bytes_after_sweep() const {
+      return free_bytes_stable;
+    }
+    /*
+     * The mean size of the free chunks left by the last sweep.  The
+     * sweep already hands out maximal free runs, so a value that falls
+     * while free_bytes_after_sweep() holds steady means live objects are
+     * scattered more thinly over the heap.
+     */
+    std::size_t mean_free_chunk_bytes() const {
+      std::size_t n = free_chunks_stable;
+      return n == 0 ? 0 : free_bytes_stable / n;
+    }
+    /*
+     * The number of free chunks of [1 << k, 2 << k) bytes the last sweep
+     * left.  Together with largest_free_chunk_bytes(), this tells whether
+     * requests of a given size can still be met from the free lists.
+     */
+    std::size_t free_chunks_in_size_class(std::size_t k) const {
+      return k < n_free_size_classes ? free_size_class_stable[k].load() : 0;
+    }
+    static constexpr std::size_t free_size_class(std::size_t bytes) {
+      return bytes == 0 ? 0 : 63 - __builtin_clzl(bytes);
+    }
+    std::size_t largest_free_chunk_bytes() const {
+      return largest_free_stable;
+    }
+    //One node per distinct free chunk size.
+    std::size_t skiplist_nodes_after_sweep() const {
+      return skiplist_nodes_stable;
+    }
+    /*
+     * Wall time of the given phase of the last sweep, from the barrier
+     * that starts it to the one that ends it, as seen by the process that
+     * finished the sweep.
+     */
+    std::chrono::nanoseconds sweep_phase_duration(sweep_phase p) const {
+      return std::chrono::nanoseconds(sweep_phase_ns[static_cast<std::size_t>(p)].load());
+    }
+    std::size_t handshake_count() const {
+      return handshakes;
+    }
+    std::chrono::nanoseconds handshake_wait_time() const {
+      return std::chrono::nanoseconds(handshake_wait_ns.load());
+    }
+    std::chrono::nanoseconds handshake_cpu_time() const {
+      return std::chrono::nanoseconds(handshake_cpu_ns.load());
+    }
+    std::chrono::nanoseconds max_handshake_wait_time() const {
+      return std::chrono::nanoseconds(handshake_max_wait_ns.load());
+    }
+    void handshake_waited(std::int64_t wait_ns, std::int64_t cpu_ns) {
+      handshakes.fetch_add(1, std::memory_order_relaxed);
+      handshake_wait_ns.fetch_add(wait_ns, std::memory_order_relaxed);
+      handshake_cpu_ns.fetch_add(cpu_ns, std::memory_order_relaxed);
+      std::int64_t longest = handshake_max_wait_ns.load(std::memory_order_relaxed);
+      while (wait_ns > longest
+             && !handshake_max_wait_ns.compare_exchange_weak(longest, wait_ns, std::memory_order_relaxed)) {}
+    }
     std::size_t inc_cycle_num_to(std::size_t n) {
       std::size_t expected = n-1;
       if (gc_cycle_num.compare_exchange_strong(expected, n)) {
 	// Yes, there's a window when these are out of sync, and yes,
 	// it's possible for the process to die in between.  I'm not
 	// terribly worried.
-	in_use_stable = in_use_current.load();
-	in_use_current = 0;
-	n_objects_stable = n_objects_current.load();
-	n_objects_current = 0;
+	fold_process_counts();
+	in_use_stable = in_use_current.exchange(0);
+	n_objects_stable = n_objects_current.exchange(0);
+	allocated_current = 0;
+	std::int64_t now = now_ns();
+	cycle_duration_ns = now - cycle_start_ns;
+	cycle_end_ns = now;
 	return n;
       } else {
 	return expected;
       }
     }
-    void marked(const offset_ptr<const gc_allocated> &p) {
-      std::size_t bytes = p->get_gc_descriptor().object_size()*8;
-      in_use_current += bytes;
-      n_objects_current++;
+    /*
+     * Adds the counts of the dead processes that
+     * process_struct_list.deletion(p, ...) is about to remove, including
+     * what their mutator threads counted in their Mpersists, into
+     * in_use_current and n_objects_current (see fold_process_counts()).
+     */
+    void fold_dead_process_counts(per_process_struct *p);
+    void allocated(std::size_t bytes) {
+      allocated_current += bytes;
+    }
+    void swept_free_chunk(std::size_t bytes) {
+      free_chunks_current.fetch_add(1, std::memory_order_relaxed);
+      free_bytes_current.fetch_add(bytes, std::memory_order_relaxed);
+      free_size_class_current[free_size_class(bytes)].fetch_add(1, std::memory_order_relaxed);
+      std::size_t largest = largest_free_current.load(std::memory_order_relaxed);
+      while (bytes > largest
+             && !largest_free_current.compare_exchange_weak(largest, bytes, std::memory_order_relaxed)) {}
+    }
+    /*
+     * Called by the process that moves the GC to Stage::Sweeped, once
+     * every process has finished sweeping.  skiplist_nodes is the node
+     * count of the free list the sweep filled.  phase_ns holds the
+     * duration of each sweep_phase, or is null if this process didn't
+     * see the whole sweep, in which case the last durations are kept.
+     */
+    void sweep_finished(std::size_t skiplist_nodes, const std::int64_t *phase_ns) {
+      free_chunks_stable = free_chunks_current.exchange(0);
+      free_bytes_stable = free_bytes_current.exchange(0);
+      largest_free_stable = largest_free_current.exchange(0);
+      for (std::size_t k = 0; k < n_free_size_classes; k++) {
+        free_size_class_stable[k] = free_size_class_current[k].exchange(0);
+      }
+      skiplist_nodes_stable = skiplist_nodes;
+      if (phase_ns != nullptr) {
+        for (std::size_t i = 0; i < n_sweep_phases; i++) {
+          sweep_phase_ns[i] = phase_ns[i];
+        }
+      }
+    }
+
+    /*
+     * Called by the process that moves the GC out of sigSweep.
+     */
+    void cycle_started() {
+      cycle_start_ns = now_ns();
+    }
+    /*
+     * Asks for a cycle to start as soon as possible, regardless of
+     * occupancy.  Used when the global free lists run dry.
+     */
+    void request_cycle() {
+      std::size_t want = gc_cycle_num + 1;
+      std::size_t current = requested_cycle;
+      while (current < want && !requested_cycle.compare_exchange_weak(current, want)) {}
+    }
+    bool cycle_requested() const {
+      return requested_cycle > gc_cycle_num;
+    }
+    /*
+     * A cycle should start if one has been requested or if, at the
+     * allocation rate seen since the last cycle ended, the heap is
+     * expected to reach target (a fraction of the heap) before a cycle
+     * of the same duration as the last one could finish.
+     */
+    bool should_start_cycle(double target) const {
+      if (cycle_requested()) {
+        return true;
+      }
+      std::size_t alloc = allocated_current;
+      std::int64_t elapsed = now_ns() - cycle_end_ns;
+      double rate = elapsed > 0 ? double(alloc) / elapsed : 0;
+      double projected = double(bytes_in_use()) + alloc + rate * cycle_duration_ns;
+      return projected >= target * bytes_in_heap();
     }
   };
 
@@ -355,15 +569,29 @@ namespace mpgc {
 
     std::atomic<Stage> stage;
 
-    gc_control_block(std::size_t size, uint8_t* after_cblock) :
+    //Bumped whenever a field is added to, removed from or moved in the control
+    //block or anything it embeds (gc_mem_stats, per_process_struct, ...), so that
+    //a process attaching to a heap created by a different build refuses it
+    //instead of misreading it. The free lists have to stay at the start of the
+    //heap, so the stamp goes last; a layout change that moves it also changes
+    //layout_size, which is checked along with it.
+    static constexpr std::uint32_t current_layout_version = 2;
+
+    const std::uint32_t layout_version;
+    const std::uint32_t layout_size;
+
+    gc_control_block(std::size_t size, uint8_t* after_cblock,
+                     bitmap_layout layout = bitmap_layout::separate) :
       bump_alloc_slots(after_cblock),
-      bitmap(size),
+      bitmap(size, layout),
       mem_stats(size, this),
       total_process_count(versioned_pcount_t()),
       marking_barrier(marking_barrier_type(Barrier_stage::incrementing, Barrier_indices::marking1)),
       weak_stage(0),
       status(gc_status(gc_handshake::Signum::sigSweep)),
-      stage(Stage::Sweeped)
+      stage(Stage::Sweeped),
+      layout_version(current_layout_version),
+      layout_size(sizeof(gc_control_block))
     {
       std::size_t size_bump_slots_block = bump_alloc_slots.sentinel[0]->get_gc_descriptor().object_size() << 3;
       std::size_t* first_free_word = reinterpret_cast<std::size_t*>(after_cblock + size_bump_slots_block);
@@ -378,7 +606,7 @@ namespace mpgc {
   };
 
   extern gc_control_block &control_block();
-  extern void init_on_createheap();
+  extern void init_on_createheap(bitmap_layout layout = bitmap_layout::separate);
 
   class bad_white_alloc : public std::bad_alloc {
     virtual const char* what() const noexcept {
@@ -413,6 +641,74 @@ namespace mpgc {
     return control_block().mem_stats;
   }
 
+  /*
+   * Runs any handshake the GC has posted to this thread. Only needed with
+   * MPGC_GC_SAFEPOINTS set (see gc_handshake::post_handshake()), in long
+   * stretches of code that neither allocate nor store pointers, which
+   * would otherwise be signalled once the safepoint deadline passes.
+   */
+  inline
+  void safepoint() {
+    initialize_thread();
+    gc_handshake::safepoint_poll(*gc_handshake::thread_struct_handles.handle);
+  }
+
+  /*
+   * A scope for code that may block for long (epoll_wait(), a long read(),
+   * ...) and that neither touches the heap nor creates or destroys gc
+   * pointers. While a thread is in one, the GC thread runs its handshakes
+   * itself, scanning the part of its stack outside the region, rather than
+   * signalling it. Leaving the region waits for such a handshake to finish.
+   * On architectures whose registers we don't know how to save, the region
+   * does nothing, and the thread is signalled as usual.
+   *
+   *   {
+   *     gc_blocked_region blocked;
+   *     n = read(fd, buf, size);
+   *   }
+   */
+  class gc_blocked_region {
+    /* Callee saved registers at entry. The code in the region may spill
+     * them below the scanned part of the stack, so we keep a copy here.
+     */
+    std::uintptr_t _registers[12];
+    gc_handshake::in_memory_thread_struct &_thread_struct;
+  public:
+    gc_blocked_region()
+      : _thread_struct((initialize_thread(), *gc_handshake::thread_struct_handles.handle))
+    {
+#ifdef __x86_64
+      asm volatile("movq %%rbx, 0(%0)\n\t"
+                   "movq %%rbp, 8(%0)\n\t"
+                   "movq %%r12, 16(%0)\n\t"
+                   "movq %%r13, 24(%0)\n\t"
+                   "movq %%r14, 32(%0)\n\t"
+                   "movq %%r15, 40(%0)\n\t"
+                   : : "r"(_registers) : "memory");
+#elif defined(__aarch64__)
+      asm volatile("stp x19, x20, [%0]\n\t"
+                   "stp x21, x22, [%0, #16]\n\t"
+                   "stp x23, x24, [%0, #32]\n\t"
+                   "stp x25, x26, [%0, #48]\n\t"
+                   "stp x27, x28, [%0, #64]\n\t"
+                   "str x29, [%0, #80]\n\t"
+                   : : "r"(_registers) : "memory");
+#else
+      return;
+#endif
+      gc_handshake::enter_blocked_region(_thread_struct);
+    }
+
+    ~gc_blocked_region() {
+      if (_thread_struct.blocked != gc_handshake::Blocked::No) {
+        gc_handshake::leave_blocked_region(_thread_struct);
+      }
+    }
+
+    gc_blocked_region(const gc_blocked_region &) = delete;
+    gc_blocked_region &operator =(const gc_blocked_region &) = delete;
+  };
+
   template <typename Fn>
   auto gc_safe(Fn &&fn) {
     typename std::decay<Fn>::type f = std::forward<Fn>(fn);
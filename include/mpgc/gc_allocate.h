@@ -40,6 +40,8 @@ namespace mpgc {
 
   extern gc_handshake::in_memory_thread_struct& allocation_prologue();
   extern void allocation_epilogue(gc_handshake::in_memory_thread_struct&, void*, gc_token&, std::size_t);
+  extern void allocation_epilogue_n(gc_handshake::in_memory_thread_struct&, void*, gc_token&,
+                                    std::size_t, std::size_t);
 
   class gc_managed_placement_t {};
   static const gc_managed_placement_t in_gc_managed_space;
@@ -48,6 +50,8 @@ namespace mpgc {
   class gc_allocator__ {
     template <typename X, typename ...Args>
     friend gc_ptr<X> make_gc(Args&&...args);
+    template <typename X, typename Fn>
+    friend void make_gc_n(std::size_t n, Fn &&init_fn);
     template <typename X> friend class gc_allocator__;
 
     static void check_descriptor() {
@@ -72,13 +76,55 @@ namespace mpgc {
                     "Has non-trivial destructor and no is_collectible<T> specialization");
 
       gc_handshake::in_memory_thread_struct& ts = allocation_prologue();
-      void *ptr = gc_allocator::alloc(ts, sizeof(T), alignof(T));
+      void *ptr = gc_allocator::fast_alloc(ts, sizeof(T), alignof(T));
       allocation_epilogue(ts, ptr, tok, 0);
 
       auto res = new (ptr) T(tok, std::forward<Args>(args)...);
       assert(&(res->get_gc_descriptor()) == ptr);
       return gc_ptr_from_bare_ptr(res);
     }
+
+    /*
+     * Allocates n objects in batches of up to a tlab's largest object, each
+     * batch contiguous and with a single allocation epilogue, so that no
+     * request needs a large free run.  The i'th object is then built by
+     * init_fn(i, construct), where construct(args...) constructs it as
+     * T(tok, args...) and returns a gc_ptr to it.  Until then the batch's
+     * objects are kept alive by the (volatile, so that the stack scan sees
+     * every one of them) array of their addresses.
+     */
+    template <typename Fn>
+    void allocate_n(std::size_t n, Fn &&init_fn) {
+      constexpr std::size_t batch_size =
+        sizeof(T) < gc_allocator::tlab::max_object_size * sizeof(std::size_t) ?
+        gc_allocator::tlab::max_object_size * sizeof(std::size_t) / sizeof(T) : 1;
+      gc_descriptor valdesc = desc_for<T>();
+      assert(valdesc.object_size()*8 == sizeof(T));
+      gc_token tok(valdesc);
+      static_assert(is_collectible<T>::value,
+                    "Has non-trivial destructor and no is_collectible<T> specialization");
+
+      T * volatile batch[batch_size];
+      for (std::size_t i = 0; i < n; ) {
+        const std::size_t k = n - i < batch_size ? n - i : batch_size;
+        gc_handshake::in_memory_thread_struct& ts = allocation_prologue();
+        void *ptr = gc_allocator::fast_alloc(ts, k * sizeof(T), alignof(T));
+        for (std::size_t j = 0; j < k; j++) {
+          batch[j] = static_cast<T*>(ptr) + j;
+        }
+        allocation_epilogue_n(ts, ptr, tok, k, valdesc.object_size());
+
+        for (std::size_t j = 0; j < k; j++, i++) {
+          T *where = batch[j];
+          init_fn(i, [&tok, where](auto&&...args) {
+              auto res = new (where) T(tok, std::forward<decltype(args)>(args)...);
+              assert(&(res->get_gc_descriptor()) == static_cast<void*>(where));
+              return gc_ptr_from_bare_ptr(res);
+            });
+          batch[j] = nullptr;
+        }
+      }
+    }
   };
   template <typename T>
   class gc_allocator__<gc_array<T>> {
@@ -94,7 +140,7 @@ namespace mpgc {
     
     static void *allocate_space_for(gc_handshake::in_memory_thread_struct &ts, size_type n) {
       std::size_t sz = sizeof(gc_array_base)+n*sizeof(value_type);
-      return gc_allocator::alloc(ts, sz, alignof(T));
+      return gc_allocator::fast_alloc(ts, sz, alignof(T));
     }
 
     std::pair<void *, gc_token> allocate_(std::size_t n) 
@@ -172,6 +218,21 @@ namespace mpgc {
     gc_allocator__<T> a;
     return a.allocate(std::forward<Args>(args)...);
   }
+  /*
+   * Allocate n Ts, e.g., when populating a large graph.  For each i,
+   * init_fn(i, construct) is called and must call construct(args...) exactly
+   * once, which constructs the i'th object from args (as with make_gc<T>())
+   * and returns a gc_ptr<T> to it.  Only that gc_ptr keeps the object alive
+   * once init_fn returns.  This amortizes the allocation prologue and
+   * epilogue over batches of small objects.
+   */
+  template <typename T, typename Fn>
+  inline
+  void make_gc_n(std::size_t n, Fn &&init_fn) {
+    gc_allocator__<T> a;
+    a.allocate_n(n, std::forward<Fn>(init_fn));
+  }
+
   template <typename T>
   inline
   gc_ptr<gc_array<T>> make_gc_array(std::size_t n) {
@@ -56,6 +56,8 @@ namespace mpgc {
     gc_descriptor _descriptor;
 
     friend void allocation_epilogue(gc_handshake::in_memory_thread_struct&, void*, gc_token&, std::size_t);
+    friend void allocation_epilogue_n(gc_handshake::in_memory_thread_struct&, void*, gc_token&,
+                                      std::size_t, std::size_t);
     //An indicator class to restrict only allocation_epilogue to be able to call the following ctor.
     class only_allocation_epilogue{};
     //Only to be called from allocation epilogue.
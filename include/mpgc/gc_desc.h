@@ -643,15 +643,6 @@ namespace mpgc {
       return cat_fld[_rep];
         }
 
-    /**
-     * Is this an array descriptor?
-     * @returns `true` if this is an array descriptor, as indicated by
-     * #is_array_fld.
-     */
-    constexpr bool is_array() const {
-      return is_array_fld[_rep];
-    }
-
     /**
      * Is this a compact (non-external) descriptor?
      * @returns `true` if this is a compact descriptor, as indicated
@@ -736,6 +727,15 @@ namespace mpgc {
     void external_for_each_ref_index(const std::function<void(std::size_t)> &) const;
 
   public:
+    /**
+     * Is this an array descriptor?
+     * @returns `true` if this is an array descriptor, as indicated by
+     * #is_array_fld.
+     */
+    constexpr bool is_array() const {
+      return is_array_fld[_rep];
+    }
+
     /** 
      * Is a type too small to contain a GC pointer?
      *
@@ -1076,6 +1076,60 @@ namespace mpgc {
     template <typename Fn>
     void for_each_ref(Fn&& fn) const;
 
+    /**
+     * Apply a function for each GC pointer contained in a range of
+     * elements of the described array.
+     *
+     * @param from the index of the first element.
+     * @param to one past the index of the last element.
+     * @params fn the function to call.
+     *
+     * Like for_each_ref(), but only for the elements in [`from`,
+     * `to`).  A reference to an external descriptor is passed in only
+     * for a range starting at 0.
+     *
+     * @pre This is an array descriptor on the GC heap, immediately
+     * before the object it describes, and `to` is at most array_length().
+     */
+    template <typename Fn>
+    void for_each_array_ref(std::size_t from, std::size_t to, Fn&& fn) const;
+
+    /**
+     * The number of elements in the described array.
+     *
+     * @pre This is an array descriptor on the GC heap, immediately
+     * before the object it describes.
+     */
+    std::size_t array_length() const;
+
+    /**
+     * The most reference fields gather_refs() handles, which is also the
+     * most a compact bitmap descriptor can describe.
+     */
+    constexpr static std::size_t max_gathered_refs = 32;
+
+    /**
+     * Batched alternative to for_each_ref() for compact scalar
+     * descriptors.
+     *
+     * @param out the array to fill with the object's references.
+     * @param n set to the number of references written to `out`.
+     * @returns `false` if the caller has to use for_each_ref() instead.
+     *
+     * Copies all of the object's reference fields at once and drops the
+     * null ones, leaving the rest, in field order, at the front of
+     * `out`.  The filtering is done branch-free over the whole batch so
+     * that it can be vectorized.  Returns `false` if this isn't a
+     * compact scalar descriptor, if it has more than #max_gathered_refs
+     * reference fields, or if any of the fields holds a weak, contingent
+     * or sweep-assigned pointer, as those need for_each_ref()'s
+     * per-field handling.
+     *
+     * @pre This is on the GC heap, immediately before the object it describes.
+     */
+    template <typename T>
+    bool gather_refs(offset_ptr<T> (&out)[max_gathered_refs], std::size_t &n) const;
+
     /**
      * Print out useful debugging information about this descriptor.
      *
@@ -1196,6 +1250,13 @@ namespace mpgc {
 	  std::forward<Fn>(fn)(p+i);
 	});
     }
+
+    /**
+     * The fields of the described object, starting with #first_field_proxy.
+     */
+    const base_offset_ptr *fields() const {
+      return &first_field_proxy;
+    }
   };
 
   /**
@@ -1262,9 +1323,18 @@ namespace mpgc {
      */
     template <typename Fn>
     void walk(Fn&& fn) const {
+      walk(0, array_length, std::forward<Fn>(fn));
+    }
+
+    /**
+     * As walk(), but only for the elements in [`from`, `to`).
+     */
+    template <typename Fn>
+    void walk(std::size_t from, std::size_t to, Fn&& fn) const {
+      assert(from <= to && to <= array_length);
       const std::size_t stride = object_n_fields();
-      const base_offset_ptr *p = &first_field_proxy;
-      for (std::size_t i=0; i<array_length; i++, p+=stride) {
+      const base_offset_ptr *p = &first_field_proxy + from*stride;
+      for (std::size_t i=from; i<to; i++, p+=stride) {
 	for_each_ref_index([&](size_t i) {
 	    std::forward<Fn>(fn)(p+i);
 	  });
@@ -1318,6 +1388,71 @@ namespace mpgc {
 
   }
 
+  template <typename Fn>
+  inline
+  void gc_descriptor::for_each_array_ref(std::size_t from, std::size_t to, Fn&& fn) const
+  {
+    assert(is_array());
+    if (from == 0 && is_external()) {
+      const base_offset_ptr *base_ptr = reinterpret_cast<const base_offset_ptr*>(this);
+      std::forward<Fn>(fn)(base_ptr);
+    }
+    as_array().walk(from, to, std::forward<Fn>(fn));
+  }
+
+  inline
+  std::size_t
+  gc_descriptor::array_length() const {
+    assert(is_array());
+    return as_array().length();
+  }
+
+  template <typename T>
+  inline
+  bool gc_descriptor::gather_refs(offset_ptr<T> (&out)[max_gathered_refs], std::size_t &n) const
+  {
+    if (!is_compact() || is_array()) {
+      return false;
+    }
+    const base_offset_ptr *fields = as_scalar().fields();
+    std::size_t words[max_gathered_refs];
+    std::size_t nr_words = 0;
+    if (is_bitmap()) {
+      const std::uint64_t in_range = (std::uint64_t(1) << bitmap_size_fld[_rep]) - 1;
+      for (std::uint32_t bm = bitmap_map_fld[_rep] & in_range; bm != 0; bm &= bm - 1) {
+        words[nr_words++] = fields[__builtin_ctz(bm)].val();
+      }
+    } else {
+      bool fits = true;
+      for_each_ref_index([&](std::size_t i) {
+          if (nr_words < max_gathered_refs) {
+            words[nr_words++] = fields[i].val();
+          } else {
+            fits = false;
+          }
+        });
+      if (!fits) {
+        return false;
+      }
+    }
+
+    constexpr std::size_t type_mask = base_offset_ptr::ptr_type_fld.encode(special_ptr_type(0b111));
+    std::size_t special = 0;
+    for (std::size_t i = 0; i < nr_words; i++) {
+      special |= words[i] & type_mask;
+    }
+    if (special != 0) {
+      return false;
+    }
+
+    n = 0;
+    for (std::size_t i = 0; i < nr_words; i++) {
+      out[n] = offset_ptr<T>(words[i]);
+      n += !base_offset_ptr::is_null(words[i]);
+    }
+    return true;
+  }
+
   /**
    * Obtain the gc_descriptor for a class.
    *
@@ -43,6 +43,7 @@
 #include <execinfo.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <signal.h>
@@ -72,6 +73,7 @@ namespace mpgc {
       sigDeferredAsync,
       sigSweep,
       sigDeferredSweep,
+      sigFlush,
       // More actions may come here.
       sigInit
     };
@@ -82,6 +84,15 @@ namespace mpgc {
       Working
     };
 
+    /* Whether a thread is inside a gc_blocked_region (see gc.h), and
+     * whether the GC thread is running a handshake on its behalf.
+     */
+    enum class Blocked : char {
+      No,
+      Yes,
+      Handshaking
+    };
+
     extern Signum *status_ptr;
     extern per_process_struct *process_struct;
     extern mark_bitmap *mbitmap;
@@ -121,6 +132,7 @@ namespace mpgc {
 
       on_stack_wp_set_type on_stack_wp_set;
       gc_allocator::localPoolType local_free_list;
+      gc_allocator::tlab tlab;
       std::mt19937 rand;
       const pthread_t pthread;
       uint8_t * const stack_end;
@@ -128,6 +140,32 @@ namespace mpgc {
       mark_bitmap * const bitmap;
       std::atomic<gc_status> status_idx;
       std::atomic<Weak_signal> weak_signal;
+      /* In safepoint mode, the handshake posted to this thread and not yet
+       * taken by safepoint_poll(), or sigInit. in_safepoint is set while
+       * the poll runs the handshake, and makes the signal fallback back off.
+       */
+      std::atomic<Signum> safepoint_requested;
+      volatile bool in_safepoint;
+      /* While blocked is not No, the thread doesn't touch the heap below
+       * blocked_stack_top, and its callee saved registers are on the stack
+       * above it.
+       */
+      std::atomic<Blocked> blocked;
+      std::size_t *blocked_stack_top;
+      /* Up to MPGC_GC_STACK_SNAPSHOT_KB of the stack beyond the first
+       * MPGC_GC_SYNC_STACK_KB, copied at the async handshake for the GC
+       * thread to scan after it (see scan_stack_snapshots()). Mapped when
+       * the thread registers. stack_snapshot_words is 0 once it's done.
+       */
+      std::size_t *stack_snapshot;
+      std::size_t stack_snapshot_capacity;
+      volatile std::size_t stack_snapshot_words;
+      /* publish_marks() moves the marks staged in persist_data to its mbuf.
+       * That happens when the staging array fills, at handshakes, when the
+       * thread dies or enters a gc_blocked_region, and when the GC asks for
+       * them before it ends marking (see request_mark_flush()).
+       */
+      std::atomic<bool> mark_flush_requested;
       volatile Alive live;
       volatile bool mark_signal_disabled;
       volatile Signum mark_signal_requested;
@@ -136,19 +174,15 @@ namespace mpgc {
       volatile bool clear_local_allocator;
 
       static bool is_marked(in_memory_thread_struct *s) { return s->live == Alive::Dead; }
-      void mark_dead() {
-        /* We must disable the signals which has side-effects before
-         * marking this structure dead.
-         */
-        mark_signal_disabled = true;
-        sweep_signal_disabled = true;
-        live = Alive::Dead;
-      }
+      void mark_dead();
+      void publish_marks();
 
       bool marked_dead() {
         return live == Alive::Dead;
       }
 
+      void leave_weak_barrier();
+
       in_memory_thread_struct() :
           rand(pthread),
           pthread(pthread_self()),
@@ -157,6 +191,14 @@ namespace mpgc {
           bitmap(mbitmap),
           status_idx(gc_status(Signum::sigInit)),
           weak_signal(Weak_signal::Working),
+          safepoint_requested(Signum::sigInit),
+          in_safepoint(false),
+          blocked(Blocked::No),
+          blocked_stack_top(nullptr),
+          stack_snapshot(nullptr),
+          stack_snapshot_capacity(0),
+          stack_snapshot_words(0),
+          mark_flush_requested(false),
           live(Alive::Live),
           mark_signal_disabled(false),
           mark_signal_requested(Signum::sigInit),
@@ -167,6 +209,9 @@ namespace mpgc {
 
       ~in_memory_thread_struct() {
         persist_data->mbuf.mark_dead();
+        if (stack_snapshot) {
+          munmap(stack_snapshot, stack_snapshot_capacity * sizeof(std::size_t));
+        }
       }
 
     private:
@@ -187,6 +232,52 @@ namespace mpgc {
       }
     };
 
+    /*
+     * The GC thread sleeps on handshake_ack_word when waiting for the
+     * acknowledgement of a handshake takes long (see wait_handshake()).
+     * Whatever may complete a thread's acknowledgement (a change of its
+     * status_idx, leaving a weak barrier the GC asked to hear about, or
+     * dying) calls notify_handshake_ack() afterwards. That costs a load,
+     * unless the GC thread is asleep.
+     */
+    extern std::atomic<uint32_t> handshake_ack_word;
+    extern std::atomic<bool> handshake_ack_waiting;
+    extern void wake_handshake_waiter();
+
+    inline void notify_handshake_ack() {
+      if (handshake_ack_waiting.load()) {
+        wake_handshake_waiter();
+      }
+    }
+
+    inline void in_memory_thread_struct::mark_dead() {
+      /* We must disable the signals which has side-effects before
+       * marking this structure dead.
+       */
+      mark_signal_disabled = true;
+      sweep_signal_disabled = true;
+      publish_marks();
+      live = Alive::Dead;
+      notify_handshake_ack();
+    }
+
+    inline void in_memory_thread_struct::publish_marks() {
+      Mpersist &m = *persist_data;
+      if (m.n_mark_staged > 0) {
+        m.mbuf.add_elements(m.mark_staging, m.n_mark_staged);
+        m.n_mark_staged = 0;
+      }
+      if (mark_flush_requested.load(std::memory_order_relaxed)) {
+        mark_flush_requested = false;
+      }
+    }
+
+    inline void in_memory_thread_struct::leave_weak_barrier() {
+      if (weak_signal.exchange(Weak_signal::Working) == Weak_signal::DoHandshake) {
+        notify_handshake_ack();
+      }
+    }
+
     typedef ruts::sequential_lazy_delete_collection<in_memory_thread_struct, std::allocator<in_memory_thread_struct>> in_memory_thread_struct_list_type;
     extern in_memory_thread_struct_list_type thread_struct_list;
 
@@ -290,6 +381,47 @@ namespace mpgc {
       }
     }
 
+    /*
+     * With MPGC_GC_SAFEPOINTS set, post_handshake() doesn't signal the
+     * threads. It sets their safepoint_requested flag instead, and each
+     * thread runs the handshake itself the next time it polls the flag:
+     * when it allocates, in the write barrier and in mpgc::safepoint().
+     * Threads that haven't acknowledged after MPGC_GC_SAFEPOINT_DEADLINE_US
+     * microseconds (1000 by default), such as those blocked in a system
+     * call, are signalled as usual (see wait_handshake()).
+     */
+    extern bool use_safepoints;
+    extern void run_safepoint(in_memory_thread_struct&);
+    /* Runs sig for a thread in a gc_blocked_region, if it still is in one.
+     * Returns false if it isn't. With requested set, sig must also still
+     * be pending in its safepoint_requested, and is taken from there.
+     */
+    extern bool handshake_blocked_thread(in_memory_thread_struct&, Signum sig, bool requested = false);
+    extern void enter_blocked_region(in_memory_thread_struct&);
+    extern void leave_blocked_region(in_memory_thread_struct&);
+    /* Called by the GC thread, which won't end marking while a thread has
+     * staged marks. Signals the thread (once until it next publishes) to
+     * publish them, and has mark_gray() publish every mark until marking
+     * ends, so that it can.
+     */
+    extern void request_mark_flush(in_memory_thread_struct&);
+    /* Publishes the thread's staged marks from outside the write barrier,
+     * deferring the mark handshakes meanwhile, since their stack scan may
+     * itself publish.
+     */
+    extern void publish_marks_deferring_handshakes(in_memory_thread_struct&);
+    extern volatile bool publish_marks_eagerly;
+    /* Called by the GC thread after the async handshake. Pushes the
+     * unmarked objects the threads' stack snapshots refer to onto q.
+     */
+    extern void scan_stack_snapshots(Traversal_queue &q);
+
+    inline void safepoint_poll(in_memory_thread_struct &thread_struct) {
+      if (thread_struct.safepoint_requested.load(std::memory_order_relaxed) != Signum::sigInit) {
+        run_safepoint(thread_struct);
+      }
+    }
+
     inline void post_handshake(Signum sig, bool doWeakCheck) {
       sigval_t sigval;
       sigval.sival_int = static_cast<char>(sig);
@@ -305,29 +437,25 @@ namespace mpgc {
             Weak_signal expected_weak_signal = Weak_signal::InBarrier;
             h->weak_signal.compare_exchange_strong(expected_weak_signal, Weak_signal::DoHandshake);
           }
-          //send signal
-          pthread_sigqueue(h->pthread, SIGRTMIN, sigval);
-        }
-        h = thread_struct_list.next(h);
-      }
-    }
-
-    inline void wait_handshake(Signum sig, bool doWeakCheck) {
-      in_memory_thread_struct *h = thread_struct_list.head();
-      while (h) {
-        // We must replace this busy loop with some other means of waiting.
-        // This is very CPU wasting mechanism.
-        while (!h->marked_dead() && (h->status_idx.load().status() != sig ||
-               (doWeakCheck && h->weak_signal == gc_handshake::Weak_signal::DoHandshake))) {
-          std::cpu_relax();
-          if (request_gc_termination) {
-            return;
+          if (h->blocked == Blocked::Yes && handshake_blocked_thread(*h, sig)) {
+            // Done on its behalf.
+          } else if (use_safepoints) {
+            h->safepoint_requested = sig;
+          } else {
+            pthread_sigqueue(h->pthread, SIGRTMIN, sigval);
           }
         }
         h = thread_struct_list.next(h);
       }
     }
 
+    /*
+     * Waits until every live thread has acknowledged sig. Spins for a
+     * while (MPGC_GC_HANDSHAKE_SPIN cpu_relax()es, 4096 by default) and then
+     * sleeps on handshake_ack_word between checks.
+     */
+    extern void wait_handshake(Signum sig, bool doWeakCheck);
+
     inline void handshake(Signum sig, bool doWeakCheck = false) {
       post_handshake(sig, doWeakCheck);
       wait_handshake(sig, doWeakCheck);
@@ -30,7 +30,6 @@
 #include <cstring>
 #include <random>
 #include <utility>
-#include <map>
 #include <stack>
 #include <atomic>
 #include "mpgc/gc_fwd.h"
@@ -172,7 +171,6 @@ namespace mpgc {
     };
    
     struct skip_node {
-      static std::atomic<std::size_t> n_skip_nodes;
       union {
         const std::size_t level_key = 0;//<level, key> pair
         std::atomic<std::size_t> level_orig_end;//For tail node
@@ -192,7 +190,6 @@ namespace mpgc {
       {
         val_next.val = nullptr;
         val_next.next[0] = n;
-        //n_skip_nodes++;
       }
 
       void clear_val() {
@@ -218,6 +215,8 @@ namespace mpgc {
 
       offset_ptr<skip_node> fast_lookup_cache[nr_slots];
       ruts::atomic16B<chunk_expansion_slot> chunk_expansion_slots[nr_slots];
+      //Nodes linked in since the last reset(), one per distinct chunk size.
+      std::atomic<std::size_t> n_nodes;
 
       uint8_t choose_top_level(std::mt19937 &rand) const {
         uint8_t ret;
@@ -459,7 +458,8 @@ namespace mpgc {
        * word.
        */
       skiplist() : head(max_level, 2, &tail),
-                   tail(level_fld.max_val(), 0, nullptr) {
+                   tail(level_fld.max_val(), 0, nullptr),
+                   n_nodes(0) {
         for (int i = 0; i < max_level; i++) {
           higher_levels[i] = &tail;
         }
@@ -483,13 +483,11 @@ namespace mpgc {
        tail.clear_val();
        std::memset(fast_lookup_cache, 0x0, sizeof(fast_lookup_cache));
        std::memset(chunk_expansion_slots, 0x0, sizeof(chunk_expansion_slots));
-       /*std::cout << std::endl
-                 << "# OF SKIP NODES LAST TIME: "
-                 << skip_node::n_skip_nodes
-                 << std::endl
-                 << std::endl;
-       skip_node::n_skip_nodes = 0;*/
-       
+       n_nodes = 0;
+      }
+
+      std::size_t node_count() const {
+        return n_nodes;
       }
 
       skip_node& tail_node() { return tail;}
@@ -558,6 +556,7 @@ namespace mpgc {
             if (!pred->val_next.next[0].compare_exchange_strong(succ, node)) {
               continue;
             }
+            n_nodes.fetch_add(1, std::memory_order_relaxed);
             //Add node in the dast lookup cache.
             if (size - 3 < nr_slots) {
               fast_lookup_cache[size - 3] = node;
@@ -686,8 +685,192 @@ namespace mpgc {
       }
     };
 
-    using localPoolType = std::map<std::size_t, local_chunk*>;
+    /*
+     * Per-thread pool of free chunks. Chunks smaller than nr_exact words are
+     * kept in exact size classes; larger ones in power-of-two buckets, where
+     * bucket i holds chunks of [2^i, 2^(i+1)) words. A bit per class/bucket
+     * records whether its list is non-empty, so that finding the smallest
+     * class that can satisfy a request is a few ctz operations, and clear()
+     * only has to reset those bits.
+     */
+    class local_pool {
+     public:
+      constexpr static std::size_t nr_exact = 256;
+      constexpr static std::size_t nr_buckets = bits_in_word();
+      constexpr static std::size_t nr_exact_words = nr_exact / bits_in_word();
+
+     private:
+      local_chunk *_exact[nr_exact];
+      local_chunk *_buckets[nr_buckets];
+      std::size_t _exact_nonempty[nr_exact_words];
+      std::size_t _bucket_nonempty;
+
+      static std::size_t bucket_of(std::size_t size) {
+        return bits_in_word() - 1 - __builtin_clzl(size);
+      }
+
+      static void push(local_chunk *&head, std::size_t &bits, std::size_t bit, local_chunk *c) {
+        std::size_t mask = std::size_t(1) << bit;
+        c->set_next((bits & mask) ? head : nullptr);
+        head = c;
+        bits |= mask;
+      }
+
+      static local_chunk *pop(local_chunk *&head, std::size_t &bits, std::size_t bit) {
+        local_chunk *c = head;
+        head = c->next();
+        if (head == nullptr) {
+          bits &= ~(std::size_t(1) << bit);
+        }
+        return c;
+      }
+
+      /* Returns the first non-empty exact class >= size, or nr_exact. */
+      std::size_t find_exact(std::size_t size) const {
+        std::size_t w = size / bits_in_word();
+        std::size_t bits = _exact_nonempty[w] & (~std::size_t(0) << (size % bits_in_word()));
+        while (bits == 0) {
+          if (++w == nr_exact_words) {
+            return nr_exact;
+          }
+          bits = _exact_nonempty[w];
+        }
+        return w * bits_in_word() + __builtin_ctzl(bits);
+      }
+
+     public:
+      local_pool() {
+        clear();
+      }
+
+      void clear() {
+        std::memset(_exact_nonempty, 0, sizeof(_exact_nonempty));
+        _bucket_nonempty = 0;
+      }
+
+      void put(local_chunk *c) {
+        std::size_t size = c->size();
+        if (size < nr_exact) {
+          push(_exact[size], _exact_nonempty[size / bits_in_word()], size % bits_in_word(), c);
+        } else {
+          std::size_t b = bucket_of(size);
+          push(_buckets[b], _bucket_nonempty, b, c);
+        }
+      }
+
+      /* Removes and returns a chunk of at least size words, or nullptr. */
+      local_chunk* get(std::size_t size) {
+        if (size < nr_exact) {
+          std::size_t s = find_exact(size);
+          if (s < nr_exact) {
+            return pop(_exact[s], _exact_nonempty[s / bits_in_word()], s % bits_in_word());
+          }
+          size = nr_exact;
+        }
+        /* Every chunk in a bucket above that of size is big enough. Only if
+         * there are none do we search size's own bucket for a fit.
+         */
+        std::size_t b = bucket_of(size);
+        std::size_t above = (b + 1 < nr_buckets) ? _bucket_nonempty & (~std::size_t(0) << (b + 1)) : 0;
+        if (above != 0) {
+          std::size_t i = __builtin_ctzl(above);
+          return pop(_buckets[i], _bucket_nonempty, i);
+        }
+        if ((_bucket_nonempty & (std::size_t(1) << b)) == 0) {
+          return nullptr;
+        }
+        for (local_chunk **pc = &_buckets[b]; *pc != nullptr; pc = &(*pc)->next()) {
+          local_chunk *c = *pc;
+          if (c->size() >= size) {
+            *pc = c->next();
+            if (_buckets[b] == nullptr) {
+              _bucket_nonempty &= ~(std::size_t(1) << b);
+            }
+            return c;
+          }
+        }
+        return nullptr;
+      }
+    };
+
+    using localPoolType = local_pool;
+
+    /*
+     * Thread-local allocation buffer: a contiguous run of free words carved
+     * out of the global free list, from which small, word-aligned objects are
+     * allocated by bumping _top. The word at _top always holds the size of the
+     * unused remainder, so that an abandoned buffer (at the sweep handshake or
+     * because the thread died) looks like any other free chunk to
+     * erase_gc_descriptors_from_free_chunk().
+     */
+    class tlab {
+      std::size_t *_top = nullptr;
+      std::size_t *_end = nullptr;
+
+     public:
+      //Objects larger than this (in words) bypass the buffer.
+      constexpr static std::size_t max_object_size = 256;
+      //Minimum size (in words) of the region handed to a refilled buffer.
+      constexpr static std::size_t refill_size = 4096;
+
+      std::size_t remaining() const {
+        return _end - _top;
+      }
+
+      void* allocate_words(std::size_t size) {
+        std::size_t *p = _top;
+        if (size > remaining()) {
+          return nullptr;
+        }
+        std::size_t *next = p + size;
+        if (next != _end) {
+          *next = _end - next;
+        }
+        //Keep the size in the first word; see the comment in alloc().
+        *p = size;
+        _top = next;
+        std::memset(p + 1, 0x0, (size - 1) << alignment_log);
+        return p;
+      }
+
+      void* allocate(std::size_t bytes, std::size_t algn) {
+        const std::size_t words = (bytes + alignment - 1) >> alignment_log;
+        if (algn > alignment || words > max_object_size) {
+          return nullptr;
+        }
+        return allocate_words(words);
+      }
+
+      /* Installs [begin, end) as the new buffer and returns the remainder of
+       * the old one, whose first word already holds its size.
+       */
+      std::pair<std::size_t*, std::size_t> reset(std::size_t *begin = nullptr,
+                                                 std::size_t *end = nullptr) {
+        std::pair<std::size_t*, std::size_t> old(_top, remaining());
+        if (begin != end) {
+          *begin = end - begin;
+        }
+        _top = begin;
+        _end = end;
+        return old;
+      }
+
+      void clear() {
+        reset();
+      }
+    };
+
    extern void* alloc (gc_handshake::in_memory_thread_struct&, std::size_t, std::size_t);
+
+    /* Inline fast path for allocation: bump the thread's tlab and only call
+     * alloc() when it is exhausted. Thread_struct is a template parameter only
+     * so that in_memory_thread_struct may still be incomplete here.
+     */
+    template <typename Thread_struct>
+    inline void* fast_alloc(Thread_struct &tstruct, std::size_t size, std::size_t req_alignment) {
+      void *p = tstruct.tlab.allocate(size, req_alignment);
+      return p != nullptr ? p : alloc(tstruct, size, req_alignment);
+    }
   }//gc_allocator
 }//mpgc
 
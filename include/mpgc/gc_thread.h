@@ -37,6 +37,8 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include<algorithm>
+#include<array>
 #include<deque>
 #include<cassert>
 #include<cstdio>
@@ -100,13 +102,42 @@ namespace mpgc {
   using Mbuf = mark_buffer<offset_ptr<const gc_allocated>>;
   struct mutator_persist {
     Mbuf mbuf;
+    /* Objects mark_gray() has staged rather than added to mbuf one at a
+     * time. publish_marks() moves them there. They are kept here, in the
+     * managed space next to mbuf, so that consume_dead_process_refs() can
+     * take them over from a process that dies.
+     */
+    static constexpr std::size_t mark_staging_size = 64;
+    offset_ptr<const gc_allocated> mark_staging[mark_staging_size];
+    volatile std::size_t n_mark_staged;
     chunk_expansion_slot expansion_slot;
     gc_allocator::slot_number slot;
+    /* Bytes and objects the thread has allocated black. Only the thread
+     * adds to them. The GC thread of its process, or the one cleaning up
+     * after the process died, moves what was added since it last looked
+     * (folded_*) into the per_process_struct (see
+     * per_process_struct::fold_mutator_counts()). Keeping them here rather
+     * than in the thread's in-memory struct means a crash doesn't lose them.
+     */
+    std::atomic<std::size_t> marked_bytes;
+    std::atomic<std::size_t> marked_objects;
+    std::size_t folded_bytes;
+    std::size_t folded_objects;
 
     static bool is_marked(mutator_persist *b) {
       return Mbuf::is_marked(&b->mbuf);
     }
-    mutator_persist() : mbuf(), slot() {}
+    mutator_persist() : mbuf(), n_mark_staged(0), slot(),
+                        marked_bytes(0), marked_objects(0),
+                        folded_bytes(0), folded_objects(0) {}
+
+    void count_marked(std::size_t bytes, std::size_t objects) {
+      //Single writer, so no read-modify-write is needed.
+      marked_bytes.store(marked_bytes.load(std::memory_order_relaxed) + bytes,
+                         std::memory_order_relaxed);
+      marked_objects.store(marked_objects.load(std::memory_order_relaxed) + objects,
+                           std::memory_order_relaxed);
+    }
     ~mutator_persist();
   };
 
@@ -114,6 +145,80 @@ namespace mpgc {
   using Mutator_persist_list = ruts::sequential_lazy_delete_collection<mutator_persist, ruts::managed_space::allocator<mutator_persist>>;
   using Traversal_queue = work_stealing_wq<offset_ptr<const gc_allocated>>;
 
+  /*
+   * Large arrays are not scanned in one go. Instead, marking an array
+   * pushes a reference per chunk of its elements on the traversal queue,
+   * so that chunks can be stolen and no single marking_ref stays pinned
+   * for long. A chunk reference is the array's offset_ptr tagged with
+   * special_ptr_type::Array_chunk, with the chunk number in the unused
+   * top byte. Chunk references never leave the traversal queues and the
+   * marking_ref/prefetch ring slots.
+   */
+  class array_chunk_ref {
+    constexpr static uint8_t chunk_shift = 56;
+    /* Arrays with fewer reference fields than this are scanned in one go. */
+    constexpr static std::size_t min_chunk_fields = 4096;
+   public:
+    constexpr static std::size_t max_chunks = std::size_t(1) << (64 - chunk_shift);
+
+    static bool is_chunk(const offset_ptr<const gc_allocated> &p) {
+      return base_offset_ptr::ptr_type_fld.decode(p.val()) == special_ptr_type::Array_chunk;
+    }
+
+    static offset_ptr<const gc_allocated> make(const offset_ptr<const gc_allocated> &array, std::size_t chunk) {
+      assert(chunk < max_chunks && !is_chunk(array) && (array.val() >> chunk_shift) == 0);
+      return offset_ptr<const gc_allocated>(base_offset_ptr::ptr_type_fld.replace(array.val(), special_ptr_type::Array_chunk) |
+                                            (chunk << chunk_shift));
+    }
+
+    static offset_ptr<const gc_allocated> array(const offset_ptr<const gc_allocated> &p) {
+      assert(is_chunk(p));
+      return offset_ptr<const gc_allocated>(base_offset_ptr::ptr_type_fld.replace(p.val() & base_offset_ptr::used_mask(),
+                                                                                  special_ptr_type::Strong));
+    }
+
+    static std::size_t chunk(const offset_ptr<const gc_allocated> &p) {
+      assert(is_chunk(p));
+      return p.val() >> chunk_shift;
+    }
+
+    /*
+     * Number of elements per chunk for the array described by desc, or 0
+     * if the array is too small to be split.
+     */
+    static std::size_t chunk_length(const gc_descriptor &desc) {
+      assert(desc.is_array());
+      const std::size_t len = desc.array_length();
+      const std::size_t fields = std::max(desc.object_n_fields(), std::size_t(1));
+      if (len * fields < 2 * min_chunk_fields) {
+        return 0;
+      }
+      return std::max((min_chunk_fields + fields - 1) / fields, (len + max_chunks - 1) / max_chunks);
+    }
+  };
+
+  class per_process_struct;
+
+  /*
+   * Marked bytes and objects counted by a single GC or marker thread.
+   * Threads count locally and flush() into their process's
+   * per_process_struct now and then, which gc_mem_stats folds in when
+   * the cycle number is incremented. This keeps the marking path off
+   * shared cache lines. Mutator threads count in their Mpersist instead.
+   */
+  struct mark_counter {
+    std::size_t bytes;
+    std::size_t objects;
+
+    mark_counter() : bytes(0), objects(0) {}
+
+    void count(const offset_ptr<const gc_allocated> &p) {
+      bytes += p->get_gc_descriptor().object_size() * 8;
+      objects++;
+    }
+    inline void flush(per_process_struct &p);
+  };
+
   using pcount_t = uint16_t;//any variable which needs to hold process count must use this.
 
   /*
@@ -186,6 +291,78 @@ namespace mpgc {
 
     using Barrier_info = marking_barrier_type;
 
+    /*
+     * A small FIFO in front of a traversal queue. References are moved
+     * here from the queue (and prefetched) a few objects before they are
+     * marked, so that the cache misses on their header and mark-bitmap
+     * word overlap with marking the objects ahead of them. As the ring
+     * is kept in the process struct, a dead process's ring is taken over
+     * along with its queue. Slots not in use are always null.
+     */
+    struct mark_prefetch_ring {
+      static constexpr std::size_t capacity = 16;
+     private:
+      std::array<offset_ptr<const gc_allocated>, capacity> _refs;
+      std::size_t _head;
+      std::size_t _count;
+     public:
+      mark_prefetch_ring() : _head(0), _count(0) {
+        _refs.fill(nullptr);
+      }
+      bool empty() const {
+        return _count == 0;
+      }
+      std::size_t size() const {
+        return _count;
+      }
+      //Pops the next reference of q straight into the ring.
+      bool refill_from(Traversal_queue &q) {
+        assert(_count < capacity);
+        if (!q.pop(_refs[(_head + _count) % capacity])) {
+          return false;
+        }
+        _count++;
+        return true;
+      }
+      offset_ptr<const gc_allocated>& front() {
+        assert(_count > 0);
+        return _refs[_head];
+      }
+      offset_ptr<const gc_allocated>& back() {
+        assert(_count > 0);
+        return _refs[(_head + _count - 1) % capacity];
+      }
+      void pop() {
+        assert(_count > 0);
+        _refs[_head] = nullptr;
+        _head = (_head + 1) % capacity;
+        _count--;
+      }
+      template <typename Fn>
+      void for_each(Fn &&fn) const {
+        for (const offset_ptr<const gc_allocated> &p : _refs) {
+          if (!p.is_null()) {
+            fn(p);
+          }
+        }
+      }
+    };
+
+    /*
+     * Each additional marker thread of the process (see
+     * MPGC_GC_MARKER_THREADS) keeps its queue, prefetch ring and the
+     * reference it is currently marking here, so that all of them can be
+     * taken over by other processes if this one dies while marking.  The
+     * GC thread itself uses _tqueue, _prefetch_ring and marking_obj_ref.
+     */
+    struct marker_slot {
+      Traversal_queue queue;
+      mark_prefetch_ring ring;
+      offset_ptr<const gc_allocated> marking_ref;
+      marker_slot() : queue(), ring(), marking_ref(nullptr) {}
+    };
+    static constexpr std::size_t max_marker_threads = 64;
+
   private:
     union {
       chunk_expansion_slot sweep1_data;
@@ -200,13 +377,34 @@ namespace mpgc {
     Barrier_info              _binfo;
     Mutator_persist_list          _mutator_persist_list;
 
+    std::atomic<std::size_t>  _marked_bytes;
+    std::atomic<std::size_t>  _marked_objects;
+
+    /* The logical chunk the process is cleaning up in weak_cleanup_phase()
+     * and the end of the batch it claimed, so that another process can
+     * finish the batch if this one dies (see finish_weak_cleanup()).
+     */
+    std::size_t               _weak_nr_chunk;
+    std::size_t               _weak_nr_chunk_end;
+
     Traversal_queue           _tqueue;
+    mark_prefetch_ring        _prefetch_ring;
+
+    std::array<marker_slot, max_marker_threads - 1> _marker_slots;
+    std::size_t               _nr_marker_slots;
 
     volatile gc_status        _status;
   public:
 
     std::atomic<uint16_t> gc_mutator_weak_sync;
     volatile bool        sweep1_enabled;
+    /* Set by the GC thread while the logical chunks of the sweep2 phase are
+     * up for grabs, so that allocating threads that find the global free
+     * list empty can sweep chunks themselves (see mutator_sweep()).
+     * lazy_sweepers counts the threads in the middle of doing so.
+     */
+    std::atomic<bool>     sweep2_enabled;
+    std::atomic<uint32_t> lazy_sweepers;
 
     chunk_expansion_slot& get_sweep1_data() { return sweep1_data;}
     chunk_expansion_slot* sweep1_data_ptr() { return &sweep1_data;}
@@ -215,8 +413,16 @@ namespace mpgc {
       sweep1_data(),
       _liveness(liveness(getpid())),
       rand(_liveness.load().creation_time),
+      _marked_bytes(0),
+      _marked_objects(0),
+      _weak_nr_chunk(0),
+      _weak_nr_chunk_end(0),
       _tqueue(),
-      sweep1_enabled(false)
+      _prefetch_ring(),
+      _nr_marker_slots(0),
+      sweep1_enabled(false),
+      sweep2_enabled(false),
+      lazy_sweepers(0)
     {
       static_assert(sizeof(liveness) <= 16, "Liveness object must be at least 16 bytes long.");
     }
@@ -243,18 +449,45 @@ namespace mpgc {
       return p->_liveness.load().is_live == Alive::Dead;
     }
     bool steal(Traversal_queue &other) {
-      return _tqueue.steal(other);
+      return _tqueue.steal(other) || steal_from_markers(other);
+    }
+    bool steal_from_markers(Traversal_queue &other) {
+      for (std::size_t i = 0; i < _nr_marker_slots; i++) {
+        if (&_marker_slots[i].queue != &other && _marker_slots[i].queue.steal(other)) {
+          return true;
+        }
+      }
+      return false;
     }
 
-    void set_marking_ref(offset_ptr<const gc_allocated> ref) {
-      assert(!marking_obj_ref);
-      marking_obj_ref = ref;
+    void add_marked(std::size_t bytes, std::size_t objects) {
+      _marked_bytes.fetch_add(bytes, std::memory_order_relaxed);
+      _marked_objects.fetch_add(objects, std::memory_order_relaxed);
+    }
+    //Returns and resets the counts added since the last call.
+    std::pair<std::size_t, std::size_t> take_marked() {
+      return std::make_pair(_marked_bytes.exchange(0), _marked_objects.exchange(0));
+    }
+    /* Adds what the mutator threads have counted in their Mpersists since
+     * the last call. Must be called by the process's GC thread, or by the
+     * one that took over the dead process, as it walks the Mpersist list.
+     */
+    void fold_mutator_counts() {
+      for (Mpersist *m = _mutator_persist_list.head(); m; m = _mutator_persist_list.next(m)) {
+        std::size_t bytes = m->marked_bytes.load(std::memory_order_relaxed);
+        std::size_t objects = m->marked_objects.load(std::memory_order_relaxed);
+        add_marked(bytes - m->folded_bytes, objects - m->folded_objects);
+        m->folded_bytes = bytes;
+        m->folded_objects = objects;
+      }
     }
+
     offset_ptr<const gc_allocated>& marking_ref() {
       return marking_obj_ref;
     }
-    void clear_marking_ref() {
-      marking_obj_ref = nullptr;
+
+    mark_prefetch_ring& prefetch_ring() {
+      return _prefetch_ring;
     }
 
     void reset_tolerate_sweep_chunk() {
@@ -265,6 +498,14 @@ namespace mpgc {
       return sweep_nr_chunk;
     }
 
+    std::size_t& get_tolerate_weak_chunk() {
+      return _weak_nr_chunk;
+    }
+
+    std::size_t& get_tolerate_weak_chunk_end() {
+      return _weak_nr_chunk_end;
+    }
+
     Barrier_info get_barrier_info() {
       return _binfo;
     }
@@ -337,7 +578,21 @@ namespace mpgc {
       return _tqueue;
     }
 
+    marker_slot &marker(std::size_t i) {
+      assert(i < _nr_marker_slots);
+      return _marker_slots[i];
+    }
+    std::size_t nr_marker_slots() const {
+      return _nr_marker_slots;
+    }
+    void set_nr_marker_slots(std::size_t n) {
+      assert(n < max_marker_threads);
+      _nr_marker_slots = n;
+    }
+
     void clear() {
+      //Threads that exited since the last fold take their counts with them otherwise.
+      fold_mutator_counts();
       _mutator_persist_list.deletion(mutator_persist::is_marked);
     }
 
@@ -359,6 +614,25 @@ namespace mpgc {
     }
   };
 
+  inline void mark_counter::flush(per_process_struct &p) {
+    if (objects) {
+      p.add_marked(bytes, objects);
+      bytes = objects = 0;
+    }
+  }
+
+  /*
+   * How the begin and end mark bits are laid out. With the separate layout
+   * they are two arrays, each covering the whole heap. With the interleaved
+   * layout the begin and end words covering the same 64 heap words are
+   * adjacent, so marking an object or testing a word in the sweep usually
+   * touches one cache line instead of two. Chosen by createheap.
+   */
+  enum class bitmap_layout : uint8_t {
+    separate,
+    interleaved
+  };
+
   class mark_bitmap {
     using rep_t = std::size_t;
     using atomic_rep_t = std::atomic<rep_t>;
@@ -369,12 +643,28 @@ namespace mpgc {
 
     static constexpr uint8_t bits_per_value = sizeof(rep_t) * 8;
     static constexpr uint8_t value_log_bits = 6;
-    static constexpr uint8_t chunk_size_log_bits = 10;
+    /* A logical chunk covers 1 << _chunk_log mark-bitmap words, chosen when
+     * the heap is created so that the heap has about
+     * 1 << target_logical_chunks_log of them, within the bounds below.
+     */
+    static constexpr uint8_t min_chunk_log_bits = 6;
+    static constexpr uint8_t max_chunk_log_bits = 12;
+    static constexpr uint8_t target_logical_chunks_log = 14;
+    /* The sweep2 phase hands out runs of up to 1 << max_sweep_batch_log
+     * logical chunks, sized at the start of each cycle so that every live
+     * process still gets about 1 << sweep_batches_per_process_log runs.
+     */
+    static constexpr uint8_t max_sweep_batch_log = 6;
+    static constexpr uint8_t sweep_batches_per_process_log = 5;
 
     const std::size_t _size;
+    const uint8_t _chunk_log;
     const std::size_t _total_logical_chunks;
     const std::size_t _sweep_bitmap_size;
     Allocator _alloc;
+    const bitmap_layout _layout;
+    //Begin (and end) word idx is at _begin[idx << _stride_log] (_end[...]).
+    const uint8_t _stride_log;
 
     atomic_rep_t * const _begin;
     atomic_rep_t * const _end;
@@ -392,12 +682,29 @@ namespace mpgc {
     atomic_rep_t * const _sweep_bitmap_begin;
     atomic_rep_t * const _sweep_bitmap_end;
 
+    /* Summary bitmap: a bit per logical chunk, set when a begin bit in the
+     * chunk is set and cleared with the chunk's begin bitmap. A clear bit
+     * means nothing is marked (or allocated black) in the chunk, which lets
+     * the sweep pass over runs of dead chunks without reading them. The bit
+     * is set before the begin word and cleared after it, so that a process
+     * dying in between leaves it over-approximating, never under.
+     */
+    atomic_rep_t * const _summary;
+    /* The same for the end bitmap: a clear bit means no object ends in the
+     * chunk. A chunk that lies entirely inside one large object has neither,
+     * and its sweep doesn't read its end words.
+     */
+    atomic_rep_t * const _end_summary;
+
     std::atomic<std::size_t> _logical_chunks;
     std::atomic<std::size_t> _sweep_bitmap_words;
+    std::atomic<std::size_t> _sweep_batch;
+    //Next logical chunk of the weak bitmap for weak_cleanup_phase().
+    std::atomic<std::size_t> _weak_chunks;
 
-    void fetch_logical_chunk_to_process(std::size_t &i) {
-      i = _logical_chunks;
-      while (!_logical_chunks.compare_exchange_weak(i, i + 1));
+    //Claims the n logical chunks from i on. i may be past the last chunk.
+    void fetch_logical_chunks_to_process(std::size_t &i, const std::size_t n) {
+      i = _logical_chunks.fetch_add(n);
     }
 
     void fetch_sweep_bitmap_word_to_process(std::size_t &i) {
@@ -454,7 +761,7 @@ namespace mpgc {
       return set ? val & expected : ~val & expected;
     }
 
-    void _post_sweep_clear(atomic_rep_t &, atomic_rep_t *, atomic_rep_t *, const bool);
+    void _post_sweep_clear(atomic_rep_t &, const std::size_t, const bool, const bool);
     void _set_sweep_bitmap_range(const std::size_t, const std::size_t, const bool);
 
     static std::size_t compute_bitmap_size(std::size_t heap_size) {
@@ -465,14 +772,14 @@ namespace mpgc {
       return compute_bitmap_index(heap_size >> 3);
     }
 
-    atomic_rep_t &lookup_begin(const bitmap_idx_t idx) {
+    atomic_rep_t &lookup_begin(const bitmap_idx_t idx) const {
       assert(idx < _size);
-      return _begin[idx];
+      return _begin[idx << _stride_log];
     }
 
-    atomic_rep_t &lookup_end(const bitmap_idx_t idx) {
+    atomic_rep_t &lookup_end(const bitmap_idx_t idx) const {
       assert(idx < _size);
-      return _end[idx];
+      return _end[idx << _stride_log];
     }
 
     atomic_rep_t &lookup_weak(const bitmap_idx_t idx) {
@@ -480,7 +787,18 @@ namespace mpgc {
       return _weak[idx];
     }
 
+    void set_summary(atomic_rep_t *summary, const bitmap_idx_t idx) {
+      const std::size_t nr_chunk = idx >> _chunk_log;
+      atomic_rep_t &S = summary[nr_chunk >> value_log_bits];
+      const rep_t summary_bit = construct_bitmap_word(nr_chunk & (bits_per_value - 1));
+      if (!(S.load(std::memory_order_relaxed) & summary_bit)) {
+        S.fetch_or(summary_bit);
+      }
+    }
+
     bool mark_begin(const bitmap_idx_t idx, const bit_number_t bit) {
+      //Summary first; see _summary.
+      set_summary(_summary, idx);
       atomic_rep_t &B = lookup_begin(idx);
       rep_t desired = construct_bitmap_word(bit);
       const rep_t res = B.fetch_or(desired);
@@ -488,6 +806,7 @@ namespace mpgc {
     }
 
     bool mark_end(const bitmap_idx_t idx, const bit_number_t bit) {
+      set_summary(_end_summary, idx);
       atomic_rep_t &B = lookup_end(idx);
       rep_t desired = construct_bitmap_word(bit);
       const rep_t res = B.fetch_or(desired);
@@ -537,13 +856,25 @@ namespace mpgc {
       return lookup_begin(idx) & construct_bitmap_word(bit);
     }
 
-    /* Let us keep it simple for now. We want every entry in the sweep_bitmap
-     * to cover 1K of rep_t mark_bitmap entries (8K memory).
-     * TODO: This function needs to be more sophisticated in the way we deal
-     * with smaller heap sizes etc.
+    /* Input is number of words in the mark-bitmap. The chunk count must stay
+     * a multiple of bits_per_value to fill the sweep bitmap words, so the
+     * chunk is made smaller for heap sizes that aren't a multiple of it.
      */
-    static constexpr std::size_t compute_logical_chunk_count(std::size_t s) {
-      return s >> chunk_size_log_bits;
+    static uint8_t compute_chunk_log(std::size_t s) {
+      const uint8_t log_size = s ? (bits_per_value - 1) - __builtin_clzl(s) : 0;
+      uint8_t log = log_size > target_logical_chunks_log + min_chunk_log_bits ?
+                    log_size - target_logical_chunks_log : min_chunk_log_bits;
+      if (log > max_chunk_log_bits) {
+        log = max_chunk_log_bits;
+      }
+      while (log > min_chunk_log_bits && (s & ((std::size_t(1) << (log + value_log_bits)) - 1))) {
+        log--;
+      }
+      return log;
+    }
+
+    static constexpr std::size_t compute_logical_chunk_count(std::size_t s, uint8_t chunk_log) {
+      return s >> chunk_log;
     }
 
     // Input is number of logical chunks of mark-bitmap.
@@ -551,41 +882,131 @@ namespace mpgc {
       return s >> value_log_bits;
     }
 
+    static constexpr bitmap_idx_t no_idx = bitmap_idx_t(-1);
+
+    //Most gaps are short, so look at a few words inline before calling out.
+    bitmap_idx_t next_non_zero_word(const atomic_rep_t *bits, bitmap_idx_t idx,
+                                    const bitmap_idx_t end_idx) const {
+      for (const bitmap_idx_t stop = std::min(idx + 4, end_idx); idx < stop; idx++) {
+        if (bits[idx << _stride_log] != 0) {
+          return idx;
+        }
+      }
+      return idx < end_idx ? skip_zero_words(bits, idx, end_idx, _stride_log) : end_idx;
+    }
+
+    /* Zeroes n words from p. Whole pages in large enough ranges are released
+     * back to the (file-backed) managed space rather than written, so that
+     * they read back as zero without being touched.
+     */
+    static void zero(atomic_rep_t *p, std::size_t n);
+
+    //Zeroes every (1 << _stride_log)'th word of the chunk's words in bits.
+    void clear_chunk(atomic_rep_t *bits, const std::size_t nr_chunk) {
+      const std::size_t words = std::size_t(1) << _chunk_log;
+      if (_stride_log == 0) {
+        zero(bits + (nr_chunk << _chunk_log), words);
+        return;
+      }
+      rep_t *p = reinterpret_cast<rep_t*>(bits + ((nr_chunk << _chunk_log) << _stride_log));
+      for (std::size_t i = 0; i < words; i++) {
+        p[i << 1] = 0;
+      }
+    }
+
     void clear_chunk_begin(const std::size_t nr_chunk) {
-      std::memset(_begin + (nr_chunk << chunk_size_log_bits), 0x0, sizeof(atomic_rep_t) << chunk_size_log_bits);
+      clear_chunk(_begin, nr_chunk);
+      _summary[nr_chunk >> value_log_bits].fetch_and(~construct_bitmap_word(nr_chunk & (bits_per_value - 1)));
+    }
+
+    //Returns the first chunk, from nr_chunk on, whose summary bit is set, or _total_logical_chunks.
+    std::size_t next_occupied_chunk(const std::size_t nr_chunk) const {
+      std::size_t w = nr_chunk >> value_log_bits;
+      if (w >= _sweep_bitmap_size) {
+        return _total_logical_chunks;
+      }
+      rep_t B = _summary[w] & construct_left_mask(nr_chunk & (bits_per_value - 1));
+      while (B == 0) {
+        if (++w == _sweep_bitmap_size) {
+          return _total_logical_chunks;
+        }
+        B = _summary[w];
+      }
+      return std::min((w << value_log_bits) + __builtin_clzl(B), _total_logical_chunks);
+    }
+
+    bool is_end_summary_set(const std::size_t nr_chunk) const {
+      return _end_summary[nr_chunk >> value_log_bits] & construct_bitmap_word(nr_chunk & (bits_per_value - 1));
     }
 
     void clear_chunk_end(const std::size_t nr_chunk) {
-      std::memset(_end + (nr_chunk << chunk_size_log_bits), 0x0, sizeof(atomic_rep_t) << chunk_size_log_bits);
+      if (!is_end_summary_set(nr_chunk)) {
+        //Nothing was ever marked in it, so it is still zero.
+        return;
+      }
+      clear_chunk(_end, nr_chunk);
+      _end_summary[nr_chunk >> value_log_bits].fetch_and(~construct_bitmap_word(nr_chunk & (bits_per_value - 1)));
+    }
+
+    void clear_chunk_weak(const std::size_t nr_chunk) {
+      zero(_weak + (nr_chunk << _chunk_log), std::size_t(1) << _chunk_log);
     }
 
   public:
 
+    /* The kernels skip_zero_words() can use. best is avx2 where the CPU has
+     * it and scalar otherwise; the others are there so that a test can check
+     * that they agree.
+     */
+    enum class scan_kernel : uint8_t { best, scalar, avx2 };
+    static bool has_scan_kernel(scan_kernel kernel);
+
+    /* Return the first index in [idx, end_idx) (or the last one below idx for
+     * the _back version) whose word in bits is non-zero, or end_idx (no_idx).
+     * Word i is at bits[i << stride_log], so these work on either layout.
+     * Runs of zero words are skipped several at a time, with AVX2 where the
+     * CPU has it.
+     */
+    static bitmap_idx_t skip_zero_words(const atomic_rep_t *bits, bitmap_idx_t idx,
+                                        const bitmap_idx_t end_idx, const uint8_t stride_log,
+                                        const scan_kernel kernel = scan_kernel::best);
+    static bitmap_idx_t skip_zero_words_back(const atomic_rep_t *bits, bitmap_idx_t idx,
+                                             const uint8_t stride_log,
+                                             const scan_kernel kernel = scan_kernel::best);
+
     static std::size_t compute_total_bitmap_size(const std::size_t heap_size) {
       std::size_t bitmap_size = compute_bitmap_size(heap_size);
-      std::size_t sweep_bitmap_size = compute_sweep_bitmap_size(compute_logical_chunk_count(bitmap_size));
-      return sizeof(atomic_rep_t) * (bitmap_size * 3 + sweep_bitmap_size * 2);
+      std::size_t sweep_bitmap_size =
+        compute_sweep_bitmap_size(compute_logical_chunk_count(bitmap_size, compute_chunk_log(bitmap_size)));
+      return sizeof(atomic_rep_t) * (bitmap_size * 3 + sweep_bitmap_size * 4);
     }
 
-    mark_bitmap(std::size_t heap_size, const Allocator &alloc = Allocator()) :
+    mark_bitmap(std::size_t heap_size,
+                bitmap_layout layout = bitmap_layout::separate,
+                const Allocator &alloc = Allocator()) :
                                          _size(compute_bitmap_size(heap_size)),
-                                         _total_logical_chunks(compute_logical_chunk_count(_size)),
+                                         _chunk_log(compute_chunk_log(_size)),
+                                         _total_logical_chunks(compute_logical_chunk_count(_size, _chunk_log)),
                                          _sweep_bitmap_size(compute_sweep_bitmap_size(_total_logical_chunks)),
                                          _alloc(alloc),
-                                         _begin(_alloc.allocate(3 * _size + 2 * _sweep_bitmap_size)),
-                                         _end(_begin + _size),
-                                         _weak(_end + _size),
+                                         _layout(layout),
+                                         _stride_log(layout == bitmap_layout::interleaved ? 1 : 0),
+                                         _begin(_alloc.allocate(3 * _size + 4 * _sweep_bitmap_size)),
+                                         _end(_begin + (layout == bitmap_layout::interleaved ? 1 : _size)),
+                                         _weak(_begin + 2 * _size),
                                          _sweep_bitmap_begin(_weak + _size),
                                          _sweep_bitmap_end(_sweep_bitmap_begin + _sweep_bitmap_size),
+                                         _summary(_sweep_bitmap_end + _sweep_bitmap_size),
+                                         _end_summary(_summary + _sweep_bitmap_size),
                                          _logical_chunks(0),
-                                         _sweep_bitmap_words(0)
+                                         _sweep_bitmap_words(0),
+                                         _sweep_batch(1),
+                                         _weak_chunks(0)
   {
-      /* TODO: This is too much of work. We have to come up with a way where we don't need to
-       * clear all the bitmaps because we can come up with a solution where the bitmaps are
-       * allocated on a new file which is already zero-initialized.
+      /* The control heap is a freshly truncated file, so punching out the
+       * bitmaps' pages costs next to nothing and leaves them zero.
        */
-      std::memset(_begin, 0x0, 3 * sizeof(atomic_rep_t) * _size +
-                               2 * sizeof(atomic_rep_t) * _sweep_bitmap_size);
+      zero(_begin, 3 * _size + 4 * _sweep_bitmap_size);
   }
 
     ~mark_bitmap() {
@@ -593,9 +1014,13 @@ namespace mpgc {
     }
 
     void clear() {
-      std::memset(_begin, 0x0, _size * sizeof(atomic_rep_t));
-      std::memset(_end,   0x0, _size * sizeof(atomic_rep_t));
-      std::memset(_weak,  0x0, _size * sizeof(atomic_rep_t));
+      //In either layout, the begin, end and weak words are contiguous.
+      zero(_begin, 3 * _size);
+      zero(_summary, 2 * _sweep_bitmap_size);
+    }
+
+    bitmap_layout layout() const {
+      return _layout;
     }
 
     void print() {
@@ -603,7 +1028,7 @@ namespace mpgc {
       std::cout << std::setfill('0') << std::hex;
       for (bitmap_idx_t i = 0; i < _size;) {
         std::cout << "[" << std::setw(3) << i << "]";
-        std::cout << std::setw(16) << _begin[i] << ":" << std::setw(16) << _end[i];
+        std::cout << std::setw(16) << lookup_begin(i) << ":" << std::setw(16) << lookup_end(i);
         std::cout << "\t";
         i++;
         if (i % 4 == 0) {
@@ -612,6 +1037,12 @@ namespace mpgc {
       }
     }
 
+    //Prefetch the begin-bitmap word that is_marked() and mark_*() will touch for p.
+    void prefetch(const offset_ptr<const gc_allocated> &p) const {
+      const std::size_t beg_word = p.offset() >> 3;
+      __builtin_prefetch(&lookup_begin(compute_bitmap_index(beg_word)), 1);
+    }
+
     bool is_marked(const offset_ptr<const gc_allocated> &p) {
       const std::size_t beg_word = p.offset() >> 3;
       return is_marked(compute_bitmap_index(beg_word), compute_bit_number(beg_word));
@@ -627,6 +1058,28 @@ namespace mpgc {
       return is_marked(compute_bitmap_index(beg_word), compute_bit_number(beg_word));
     }
 
+    /*
+     * Keeps only the unmarked references among refs[0..n), in order, and
+     * returns how many there are. All the bitmap words are computed and
+     * loaded before any of them is tested, so that the loads overlap.
+     */
+    std::size_t filter_unmarked(offset_ptr<const gc_allocated> *refs, const std::size_t n) {
+      assert(n <= gc_descriptor::max_gathered_refs);
+      rep_t words[gc_descriptor::max_gathered_refs];
+      rep_t bits[gc_descriptor::max_gathered_refs];
+      for (std::size_t i = 0; i < n; i++) {
+        const std::size_t beg_word = refs[i].offset() >> 3;
+        words[i] = lookup_begin(compute_bitmap_index(beg_word));
+        bits[i] = construct_bitmap_word(compute_bit_number(beg_word));
+      }
+      std::size_t nr_unmarked = 0;
+      for (std::size_t i = 0; i < n; i++) {
+        refs[nr_unmarked] = refs[i];
+        nr_unmarked += !(words[i] & bits[i]);
+      }
+      return nr_unmarked;
+    }
+
     void mark_weak(const offset_ptr<std::size_t> p) {
       return mark_weak(p.offset() >> 3);
     }
@@ -645,18 +1098,27 @@ namespace mpgc {
       mark_begin_first(beg_word, end_word);
     }
 
+    //Word-level versions of mark_end_first() and is_marked(), for tools/bitmap-bench.
+    bool mark_words(const std::size_t beg_word, const std::size_t end_word) {
+      return _mark_end_first(beg_word, end_word);
+    }
+
+    bool is_word_marked(const std::size_t word) {
+      return is_marked(compute_bitmap_index(word), compute_bit_number(word));
+    }
+
     std::size_t find_next_free_word(std::size_t word, std::size_t end, bool &found_set_bit) const {
       bit_number_t bit = compute_bit_number(word);
       bitmap_idx_t idx = compute_bitmap_index(word);
       bitmap_idx_t end_idx = compute_bitmap_index(end);
       do {
-        rep_t B = _end[idx] & construct_left_mask(bit);
-        while (B == 0) {
-          idx++;
+        rep_t B = lookup_end(idx) & construct_left_mask(bit);
+        if (B == 0) {
+          idx = next_non_zero_word(_end, idx + 1, end_idx);
           if (idx == end_idx) {
             return idx << value_log_bits;
           }
-          B = _end[idx];
+          B = lookup_end(idx);
         }
         found_set_bit = true;
         if (B == 1) {
@@ -668,7 +1130,7 @@ namespace mpgc {
         } else {
           bit = __builtin_clzl(B) + 1;
         }
-      } while (_begin[idx] & construct_bitmap_word(bit));
+      } while (lookup_begin(idx) & construct_bitmap_word(bit));
       return (idx << value_log_bits) + bit;
     }
 
@@ -679,13 +1141,13 @@ namespace mpgc {
       if (idx >= end_idx) {
         return idx << value_log_bits;
       }
-      rep_t B = _begin[idx] & construct_left_mask(bit);
-      while (B == 0) {
-        idx++;
+      rep_t B = lookup_begin(idx) & construct_left_mask(bit);
+      if (B == 0) {
+        idx = next_non_zero_word(_begin, idx + 1, end_idx);
         if (idx == end_idx) {
           return idx << value_log_bits;
         }
-        B = _begin[idx];
+        B = lookup_begin(idx);
       }
       return (idx << value_log_bits) + __builtin_clzl(B);
     }
@@ -694,28 +1156,50 @@ namespace mpgc {
     std::size_t find_prev_used_word(std::size_t word) const {
       bit_number_t bit = compute_bit_number(word);
       bitmap_idx_t idx = compute_bitmap_index(word);
-      rep_t B = _end[idx];
+      rep_t B = lookup_end(idx);
       B &= construct_right_mask(bit);
-      while (B == 0) {
-        if (idx == 0) {
+      if (B == 0) {
+        idx = skip_zero_words_back(_end, idx, _stride_log);
+        if (idx == no_idx) {
           return 0;
         }
-        B = _end[--idx];
+        B = lookup_end(idx);
       }
       return (idx << value_log_bits) + (bits_per_value - __builtin_ctzl(B));
     }
 
-    void reset_logical_chunk_count() {
+    //Called by every process at the start of a cycle, before anyone sweeps.
+    void reset_logical_chunk_count(const std::size_t nr_processes) {
       _logical_chunks = 0;
       _sweep_bitmap_words = 0;
+      _weak_chunks = 0;
+      const std::size_t per_process =
+        _total_logical_chunks / (std::max(nr_processes, std::size_t(1)) << sweep_batches_per_process_log);
+      const uint8_t log = per_process ? (bits_per_value - 1) - __builtin_clzl(per_process) : 0;
+      _sweep_batch = std::size_t(1) << (log < max_sweep_batch_log ? log : max_sweep_batch_log);
+    }
+
+    bool has_unclaimed_logical_chunks() const {
+      return _logical_chunks < _total_logical_chunks;
     }
 
     //nr_chunk: chunk number from where to start.
     std::size_t process_next_chunk_begin(std::size_t nr_chunk, const bool set_bit) {
-      constexpr std::size_t bits_to_shift = chunk_size_log_bits + value_log_bits;
+      const std::size_t bits_to_shift = _chunk_log + value_log_bits;
       std::size_t start = nr_chunk << bits_to_shift;
       std::size_t end = (nr_chunk + 1) << bits_to_shift;
       while (start < (_size << value_log_bits)) {
+        //Chunks with nothing marked in them are swept without reading them.
+        const std::size_t occupied = next_occupied_chunk(nr_chunk);
+        if (occupied > nr_chunk) {
+          _set_sweep_bitmap_range(nr_chunk, occupied - 1, set_bit);
+          nr_chunk = occupied;
+          start = nr_chunk << bits_to_shift;
+          end = (nr_chunk + 1) << bits_to_shift;
+          if (nr_chunk == _total_logical_chunks) {
+            break;
+          }
+        }
         start = find_next_used_word(start, end);
         if (start < end) {
           /* TODO: We can have an optimization here. If the set bit is the
@@ -742,8 +1226,8 @@ namespace mpgc {
       }
 
       for(i = 0; i < _size; i++) {
-        assert(_begin[i] == 0);
-        assert(_end[i] == 0);
+        assert(lookup_begin(i) == 0);
+        assert(lookup_end(i) == 0);
         assert(_weak[i] == 0);
       }
     }
@@ -756,10 +1240,13 @@ namespace mpgc {
     void post_sweep_clear(const std::size_t, const bool);
     void process_logical_chunk(gc_control_block&,
                                gc_allocator::skiplist&,
+                               chunk_expansion_slot&,
+                               std::mt19937&,
                                const std::size_t,
                                const bool);
     void _cleanup_sweep1_phase(per_process_struct*, gc_allocator::skiplist&, const bool);
-    void cleanup_weak_ptrs(gc_control_block&, std::size_t, const std::size_t);
+    void cleanup_weak_word(gc_control_block&, std::size_t*, rep_t);
+    void cleanup_weak_ptrs(gc_control_block&, const std::size_t);
     void verify_weak_ptrs_cleanup();
     void verify_weak_ptr_cleanup(std::size_t*);
     //void cleanup_weak_ptr(std::size_t*);
@@ -768,6 +1255,10 @@ namespace mpgc {
     void expand_and_put_chunk(gc_control_block&, gc_allocator::skiplist&, chunk_expansion_slot&, const bool, std::mt19937&);
     void sweep1_phase(gc_control_block&, chunk_expansion_slot&, std::mt19937&,const uint8_t, const bool, const bool);
     void sweep2_phase(const bool);
+    void weak_cleanup_phase(gc_control_block&);
+    void finish_weak_cleanup(gc_control_block&, per_process_struct*);
+    bool sweep_unclaimed_chunk(gc_control_block&, gc_allocator::skiplist&,
+                               chunk_expansion_slot&, std::mt19937&, const bool);
     void mark_gc_control_block();
   };
 }
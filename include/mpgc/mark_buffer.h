@@ -95,6 +95,23 @@ namespace mpgc {
       b->write_idx++;
     }
 
+    //Like add_element() for each of n elements, with one fence per buffer filled.
+    void add_elements(const T *e, std::size_t n) {
+      while (n > 0) {
+        buffer *b = _queue.tail();
+        if (!b || b->write_idx == buffer_size) {
+          b = _queue.enqueue();
+        }
+        const int32_t idx = b->write_idx;
+        const std::size_t k = std::min(n, std::size_t(buffer_size - idx));
+        std::copy(e, e + k, b->buf + idx);
+        std::atomic_thread_fence(std::memory_order_release);
+        b->write_idx = idx + k;
+        e += k;
+        n -= k;
+      }
+    }
+
     template <typename Fn, typename ...Args>
     void process_element(Fn&& func, Args&& ...args) {
       buffer *b = _queue.head();
@@ -45,12 +45,15 @@ namespace mpgc {
     template <typename Fn, typename ...Args>
     void process_stack(in_memory_thread_struct&, const std::size_t*, const std::size_t*, Fn&&, Args&& ...);
     void process_stack_weak_ptrs(in_memory_thread_struct&, std::size_t*, std::size_t * const);
+    template <typename Fn>
+    void process_stack_snapshot(const std::size_t*, const std::size_t*, Fn&&);
   }
 
   namespace gc_allocator {
     class skiplist;
   }
 
+  class array_chunk_ref;
   template <typename T> class offset_ptr;
   template <typename T> class gc_ptr;
   template <typename T> class weak_gc_ptr;
@@ -62,7 +65,8 @@ namespace mpgc {
     Weak = 0b001,
     Contingent = 0b010,
     Sweep_assigned_no_weak = 0b100, //For internal use only
-    Sweep_assigned = 0b101 //Also indicates that it's a weak ptr
+    Sweep_assigned = 0b101, //Also indicates that it's a weak ptr
+    Array_chunk = 0b011 //For internal use only, in the GC's traversal queue
   };
 
   class base_offset_ptr {
@@ -96,6 +100,7 @@ namespace mpgc {
     friend class gc_descriptor;
     friend class mark_bitmap;
     friend class gc_allocator::skiplist;
+    friend class array_chunk_ref;
 
     constexpr static std::size_t used_mask() {
       return (std::size_t(1) << used_bits()) - 1;
@@ -315,10 +320,12 @@ namespace mpgc {
     friend class gc_descriptor;
     template <typename Fn, typename ...Args> friend void gc_handshake::process_stack(gc_handshake::in_memory_thread_struct&, const std::size_t*, const std::size_t*, Fn&&, Args&& ...);
     friend void gc_handshake::process_stack_weak_ptrs(gc_handshake::in_memory_thread_struct&, std::size_t*, std::size_t * const);
+    template <typename Fn> friend void gc_handshake::process_stack_snapshot(const std::size_t*, const std::size_t*, Fn&&);
     friend class weak_gc_ptr<T>;
     friend class controlled_gc_ptr<T>;
     template <typename X, typename Y> friend class contingent_gc_ptr;
     friend class mark_bitmap;
+    friend class array_chunk_ref;
 
     constexpr explicit offset_ptr(std::size_t o) : base_offset_ptr(o) {}
     
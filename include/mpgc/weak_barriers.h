@@ -114,7 +114,7 @@ namespace mpgc {
           }
       }
     } while (!_atomic_pair.compare_exchange_strong(old, des) && !try_once);
-    thread_struct.weak_signal = gc_handshake::Weak_signal::Working;
+    thread_struct.leave_weak_barrier();
     thread_struct.sweep_signal_disabled = false;
     if (thread_struct.sweep_signal_requested) {
       thread_struct.sweep_signal_requested = false;
@@ -149,7 +149,7 @@ namespace mpgc {
       tstruct.sweep_signal_requested = false;
       gc_handshake::do_deferred_sweep_signal(tstruct);
     }
-    tstruct.weak_signal = gc_handshake::Weak_signal::Working;
+    tstruct.leave_weak_barrier();
   }
 
   template<typename T> template<typename LoadFn, typename ModFn>
@@ -230,7 +230,7 @@ namespace mpgc {
       }
     }
     std::forward<ModFn>(mod_func)(r);
-    thread_struct.weak_signal = gc_handshake::Weak_signal::Working;
+    thread_struct.leave_weak_barrier();
     /*
      * It is essential to defer sweep handshake for entire duration
      * of a write barrier for correct handling of sweep-assigned weak
@@ -259,7 +259,7 @@ namespace mpgc {
       }
 
       ~weak_barrier_handle() {
-        tstruct.weak_signal = gc_handshake::Weak_signal::Working;
+        tstruct.leave_weak_barrier();
 
         tstruct.sweep_signal_disabled = false;
         if (tstruct.sweep_signal_requested) {
@@ -327,7 +327,7 @@ namespace mpgc {
       }
 
       ~weak_barrier_handle() {
-        tstruct.weak_signal = gc_handshake::Weak_signal::Working;
+        tstruct.leave_weak_barrier();
         tstruct.sweep_signal_disabled = false;
         if (tstruct.sweep_signal_requested) {
           tstruct.sweep_signal_requested = false;
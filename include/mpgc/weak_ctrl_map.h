@@ -34,6 +34,7 @@
 
 #include "ruts/uniform_key.h"
 #include "ruts/cuckoo_map.h"
+#include "ruts/lock_free_stack.h"
 
 namespace mpgc {
   template <typename T>
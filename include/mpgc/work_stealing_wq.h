@@ -34,135 +34,239 @@
 #ifndef GC_WORK_STEALING_WQ_H
 #define GC_WORK_STEALING_WQ_H
 
-#include "ruts/lock_free_stack.h"
-#include "mark_buffer.h"
+#include<cassert>
+#include<cstdint>
+#include<atomic>
+#include<memory>
+#include<algorithm>
+
+#include "ruts/managed.h"
 
 namespace mpgc {
 
+  /*
+   * A Chase-Lev work-stealing deque living in managed space. The owner
+   * pushes and pops at the bottom, while any thread of any process can
+   * steal from the top. The element array grows (by doubling) when full.
+   * Arrays replaced by a larger one are kept until the deque is destroyed,
+   * as a thief may still be reading from them; they never add up to more
+   * than the current array.
+   *
+   * Fault tolerance: an element is always copied to its destination before
+   * it is removed from the deque, so a process dying in the middle of a
+   * pop or a steal can at worst cause an element to be processed twice.
+   * A thief copies the elements it steals past the bottom of its own deque
+   * (counting them in _pending) before claiming them, and publishes them
+   * once done. takeover() therefore copies everything up to
+   * bottom + _pending of a dead process's deque.
+   */
   template<typename T>
   class work_stealing_wq {
-    static constexpr int32_t buffer_size = mark_buffer<T>::buffer_size;
-    using buffer = typename mark_buffer<T>::buffer;
+    using index_t = std::int64_t;
+    using byte_allocator = ruts::managed_space::allocator<std::uint8_t>;
 
-    ruts::lf_stack<buffer, ruts::managed_space::allocator<buffer>> _stack;
-    buffer *_front;
-    buffer *_back;
+    static constexpr std::size_t initial_capacity = 1024;
 
-   public:
+    struct elem_array {
+      const std::size_t mask;
+      elem_array *const retired;
 
-    work_stealing_wq() : _stack(), _front(nullptr), _back(nullptr) {}
-    ~work_stealing_wq() {
-      _stack.clear();
-      if (_front) {
-        _stack.deallocate(_front);
+      elem_array(std::size_t capacity, elem_array *r) : mask(capacity - 1), retired(r) {
+        assert((capacity & mask) == 0);
+        std::uninitialized_fill_n(elems(), capacity, T());
       }
-      if (_back) {
-        _stack.deallocate(_back);
+
+      std::size_t capacity() const {
+        return mask + 1;
       }
-    }
 
-    bool empty() {
-      if (_front || _back) {
-        return false;
-      } else {
-        _stack.pop(_back);
-        return !_back;
-      } 
-    }
+      T *elems() {
+        return reinterpret_cast<T*>(this + 1);
+      }
 
-    /* TODO: There is a fault-tolerance issue here. If the process
-     * crashes after pushing a full local buffer, but before erasing
-     * the pointer to it, the buffer may get accessed after it is
-     * deallocated by a stealing process. To deal with it, we can
-     * mantain a free list, so that only the owner deallocates
-     * buffers, or reuses them.
-     */
-    void push(const T &p) {
-      if (_back && _back->write_idx == buffer_size) {
-        if (!_front) {
-          _front = _stack.allocate();
+      T &operator[](index_t i) {
+        return elems()[i & mask];
+      }
+
+      static elem_array *create(std::size_t capacity, elem_array *retired) {
+        void *mem = byte_allocator().allocate(sizeof(elem_array) + capacity * sizeof(T));
+        return new (mem) elem_array(capacity, retired);
+      }
+
+      static void destroy(elem_array *a) {
+        while (a) {
+          elem_array *r = a->retired;
+          byte_allocator().deallocate(reinterpret_cast<std::uint8_t*>(a), 1);
+          a = r;
         }
-        assert(_front->write_idx < buffer_size);
-        _front->buf[_front->write_idx] = p;
-        _front->write_idx++;
-
-        if (_front->write_idx == buffer_size) {
-          _stack.push(_back);
-          _back = _front;
-          _front = nullptr;
+      }
+    };
+
+    std::atomic<index_t> _top;
+    std::atomic<index_t> _bottom;
+    std::atomic<elem_array*> _array;
+    /* Number of elements a steal in progress has copied past _bottom. */
+    volatile index_t _pending;
+
+    /*
+     * Makes sure that there is room for one more element past
+     * _bottom + _pending, and returns the array to write it to. Only
+     * called by the owner.
+     */
+    elem_array *reserve() {
+      elem_array *a = _array.load(std::memory_order_relaxed);
+      const index_t t = _top.load(std::memory_order_acquire);
+      const index_t b = _bottom.load(std::memory_order_relaxed) + _pending;
+      if (!a) {
+        a = elem_array::create(initial_capacity, nullptr);
+        _array.store(a, std::memory_order_release);
+      } else if (static_cast<std::size_t>(b - t) >= a->capacity()) {
+        elem_array *n = elem_array::create(a->capacity() << 1, a);
+        for (index_t i = t; i < b; i++) {
+          (*n)[i] = (*a)[i];
         }
-      } else {
-        if (!_back) {
-          assert(!_front);
-          _back = _stack.allocate();
-        } 
-        _back->buf[_back->write_idx] = p;
-        _back->write_idx++;
+        _array.store(n, std::memory_order_release);
+        a = n;
       }
+      return a;
     }
 
-    /* For both pop() and front(), it is necessary that
-     * it is ensured that the queue is not empty. That is
-     * empty() function ensures that we have something to
-     * refer via front() and/or pop().
+    /*
+     * Claims the element at _top for a thief. The element is copied to
+     * dest before being claimed, and dest is reset if the claim fails.
      */
-    void pop() {
-      assert(_front || _back);
-      if (_front && _front->write_idx > 0) {
-        _front->write_idx--;
-        if (_front->write_idx == 0) {
-          _stack.deallocate(_front);
-          _front = nullptr;
-        }
-      } else {
-        assert(!_front && _back->write_idx > 0);
-        _back->write_idx--;
-        if (_back->write_idx == 0) {
-          _stack.deallocate(_back);
-          _back = nullptr;
-        }
+    bool steal_one(T &dest) {
+      index_t t = _top.load(std::memory_order_acquire);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      const index_t b = _bottom.load(std::memory_order_acquire);
+      if (t >= b) {
+        return false;
+      }
+      dest = (*_array.load(std::memory_order_acquire))[t];
+      if (!_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+        dest = T();
+        return false;
       }
+      return true;
     }
 
-    T& front() const {
-      assert(_front || _back);
-      if (_front) {
-        assert(_front->write_idx > 0);
-        return _front->buf[_front->write_idx - 1];
-      } else {
-        assert(_back->write_idx > 0);
-        return _back->buf[_back->write_idx - 1];
+   public:
+
+    work_stealing_wq() : _top(0), _bottom(0), _array(nullptr), _pending(0) {}
+    ~work_stealing_wq() {
+      elem_array::destroy(_array.load());
+    }
+
+    /* Only meaningful to the owner: thieves may empty the deque at any time. */
+    bool empty() const {
+      return _bottom.load(std::memory_order_relaxed) <= _top.load(std::memory_order_relaxed);
+    }
+
+    //Likewise an upper bound, to the owner.
+    std::size_t size() const {
+      const index_t n = _bottom.load(std::memory_order_relaxed) - _top.load(std::memory_order_relaxed);
+      return n > 0 ? n : 0;
+    }
+
+    void push(const T &p) {
+      assert(_pending == 0);
+      elem_array *a = reserve();
+      const index_t b = _bottom.load(std::memory_order_relaxed);
+      (*a)[b] = p;
+      _bottom.store(b + 1, std::memory_order_release);
+    }
+
+    /*
+     * Pops the most recently pushed element into dest. dest is written
+     * before the element is removed, and is reset to T() if there was
+     * nothing to pop or a thief took the last element first.
+     */
+    bool pop(T &dest) {
+      index_t b = _bottom.load(std::memory_order_relaxed);
+      index_t t = _top.load(std::memory_order_relaxed);
+      if (b <= t) {
+        dest = T();
+        return false;
       }
+      b--;
+      dest = (*_array.load(std::memory_order_relaxed))[b];
+      _bottom.store(b, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      t = _top.load(std::memory_order_relaxed);
+      if (t < b) {
+        return true;
+      }
+      //Either the last element, for which we race with thieves, or thieves took everything.
+      const bool ret = t == b &&
+                       _top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+      if (!ret) {
+        dest = T();
+      }
+      _bottom.store(b + 1, std::memory_order_relaxed);
+      return ret;
     }
 
+    /*
+     * Steals up to half (rounded up) of the elements of this deque into
+     * other, which must be owned by the calling thread. Returns false if
+     * nothing could be stolen.
+     */
     bool steal(work_stealing_wq &other) {
-      assert(other.empty());
-      _stack.pop(other._back);
-      return other._back != nullptr;
+      assert(this != &other && other._pending == 0);
+      const index_t avail = _bottom.load(std::memory_order_acquire) - _top.load(std::memory_order_acquire);
+      if (avail <= 0) {
+        return false;
+      }
+      const index_t want = (avail + 1) >> 1;
+      while (other._pending < want) {
+        elem_array *a = other.reserve();
+        T &dest = (*a)[other._bottom.load(std::memory_order_relaxed) + other._pending];
+        //Count the slot before claiming, so that takeover() sees it if we die right after.
+        other._pending = other._pending + 1;
+        if (!steal_one(dest)) {
+          other._pending = other._pending - 1;
+          if (empty()) {
+            break;
+          }
+        }
+      }
+      const index_t n = other._pending;
+      other._bottom.store(other._bottom.load(std::memory_order_relaxed) + n, std::memory_order_release);
+      other._pending = 0;
+      return n > 0;
     }
 
     /*
-     * TODO: Ideally we should deallocate the local chunks
-     * that we take over. However, we cannot to avoid double
-     * free. The best solution is to start using GC heap for
-     * GC data structures too. At the moment we leak memory.
+     * Moves all the elements of a dead process's deque, including the
+     * ones a steal in progress had copied, into this one, which must be
+     * owned by the calling thread. Like a steal, the elements are copied
+     * past our bottom before they are claimed, all at once, so that a
+     * thief still stealing from the dead deque gets none of them twice.
      */
-     
-    void takeover_locals(work_stealing_wq &other) {
-      if (other._front) {
-        for (int32_t i = 0; i < other._front->write_idx; i++) {
-          push(other._front->buf[i]);
-        }
-        //other._stack.deallocate(other._front);
-        other._front = nullptr;
+    void takeover(work_stealing_wq &other) {
+      assert(this != &other && _pending == 0);
+      elem_array *a = other._array.load(std::memory_order_acquire);
+      if (!a) {
+        return;
       }
-      if (other._back) {
-        for (int32_t i = 0; i < other._back->write_idx; i++) {
-          push(other._back->buf[i]);
+      index_t t = other._top.load(std::memory_order_acquire);
+      const index_t b = other._bottom.load(std::memory_order_acquire);
+      do {
+        _pending = 0;
+        for (index_t i = t; i < b; i++) {
+          elem_array *mine = reserve();
+          (*mine)[_bottom.load(std::memory_order_relaxed) + _pending] = (*a)[i];
+          _pending = _pending + 1;
         }
-        //other._stack.deallocate(other._back);
-        other._back = nullptr;
+      } while (t < b && !other._top.compare_exchange_strong(t, b));
+      //Nobody but the dead process itself could have claimed these.
+      for (index_t i = b; i < b + other._pending; i++) {
+        elem_array *mine = reserve();
+        (*mine)[_bottom.load(std::memory_order_relaxed) + _pending] = (*a)[i];
+        _pending = _pending + 1;
       }
+      _bottom.store(_bottom.load(std::memory_order_relaxed) + _pending, std::memory_order_release);
+      _pending = 0;
     }
   };
 }
@@ -39,12 +39,24 @@
 namespace mpgc {
   /*
    * The function is used to mark gray an object. Marking gray
-   * means adding the object reference in the mark buffer.
-   * Called by write barrier and stack scanning function.
+   * means adding the object reference in the mark buffer, by way of
+   * the thread's mark_staging array, which is published a batch at a
+   * time. Called by write barrier and stack scanning function.
    */
   inline void mark_gray(const offset_ptr<const gc_allocated> p, gc_handshake::in_memory_thread_struct &thread_struct) {
     if (p.is_valid() && !p.is_weak() && !thread_struct.bitmap->is_marked(p)) {
-      thread_struct.persist_data->mbuf.add_element(p);
+      Mpersist &m = *thread_struct.persist_data;
+      std::size_t n = m.n_mark_staged;
+      m.mark_staging[n++] = p;
+      /* Only the compiler needs ordering here: a process that dies has
+       * finished its stores before another one takes over its marks.
+       */
+      std::atomic_signal_fence(std::memory_order_release);
+      m.n_mark_staged = n;
+      if (n == Mpersist::mark_staging_size ||
+          gc_handshake::publish_marks_eagerly) {
+        thread_struct.publish_marks();
+      }
     }
   }
 
@@ -77,6 +89,7 @@ namespace mpgc {
     assert(!l.is_valid() || l->get_gc_descriptor().is_valid());
     assert(!rhs.is_valid() || rhs->get_gc_descriptor().is_valid());
 
+    gc_handshake::safepoint_poll(thread_struct);
     thread_struct.mark_signal_disabled = true;
 
     /* The following signal_fence because the sync/async disabling above
@@ -109,6 +122,7 @@ namespace mpgc {
     case gc_handshake::Signum::sigSync2:
       thread_struct.status_idx = gc_status(thread_struct.mark_signal_requested,
                                            thread_struct.status_idx.load().index());
+      gc_handshake::notify_handshake_ack();
       break;
     case gc_handshake::Signum::sigAsync:
       gc_handshake::do_deferred_async_signal(thread_struct);
@@ -46,6 +46,26 @@ namespace ruts {
   bool env_flag(const char *var);
   std::string env_string(const char *var);
 
+  /*
+   * Parses the environment variable as a T.  If it is unset, empty,
+   * or unparseable, dflt is returned.
+   */
+  template <typename T>
+  T env_value(const char *var, T dflt) {
+    std::string s = env_string(var);
+    if (s.empty()) {
+      return dflt;
+    }
+    std::istringstream in(s);
+    T val;
+    if (in >> val) {
+      return val;
+    }
+    std::cerr << "${" << var << "} contains strange value '" << s << "'.  Assuming "
+              << dflt << "." << std::endl;
+    return dflt;
+  }
+
   class reset_flags_on_exit {
     std::ios_base &_stream;
     decltype(_stream.flags()) _flags = _stream.flags();
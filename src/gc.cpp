@@ -119,13 +119,26 @@ namespace mpgc {
       base_offset_ptr::initialize(p, st.st_size);
       //gc_control_block &block = ruts::managed_space::find_or_construct<gc_control_block>(42, p, st.st_size);
       //gc_allocator::initialize(st.st_size, block.global_free_list);
+      if (std::size_t(st.st_size) < sizeof(gc_control_block)) {
+        std::cout << "Heap file '" << gc_heap_file() << "' is too small for the control block ("
+                  << st.st_size << " < " << sizeof(gc_control_block) << " bytes)" << std::endl;
+        std::abort();
+      }
       cblock = reinterpret_cast<gc_control_block*>(p);
+      if (cblock->layout_version != gc_control_block::current_layout_version
+          || cblock->layout_size != sizeof(gc_control_block)) {
+        std::cout << "Heap file '" << gc_heap_file() << "' has control block layout version "
+                  << cblock->layout_version << " (" << cblock->layout_size << " bytes), but this build expects "
+                  << gc_control_block::current_layout_version << " (" << sizeof(gc_control_block)
+                  << " bytes). Recreate the heap with createheap." << std::endl;
+        std::abort();
+      }
       gc_handshake::initialize1();
     });
     gc_handshake::initialize2();
   }
 
-  void init_on_createheap() {
+  void init_on_createheap(bitmap_layout layout) {
       int fd = open(gc_heap_file().data(), O_RDWR, S_IRUSR | S_IWUSR);
       if (fd == -1) {
         std::cout << "Could not open heap file '" << gc_heap_file() << "': "
@@ -150,7 +163,12 @@ namespace mpgc {
 
       base_offset_ptr::initialize(p, st.st_size);
 
-      cblock = new (p) gc_control_block(st.st_size, p + sizeof(gc_control_block));
+      if (std::size_t(st.st_size) < sizeof(gc_control_block)) {
+        std::cout << "Heap file '" << gc_heap_file() << "' is too small for the control block ("
+                  << st.st_size << " < " << sizeof(gc_control_block) << " bytes)" << std::endl;
+        std::abort();
+      }
+      cblock = new (p) gc_control_block(st.st_size, p + sizeof(gc_control_block), layout);
   }
 
   gc_control_block &control_block() {
@@ -159,6 +177,25 @@ namespace mpgc {
     return b;
   }
 
+  void gc_mem_stats::fold_process_counts() {
+    perProcessList &list = cblk->process_struct_list;
+    for (per_process_struct *p = list.head(); p != nullptr; p = list.next(p)) {
+      std::pair<std::size_t, std::size_t> counts = p->take_marked();
+      in_use_current += counts.first;
+      n_objects_current += counts.second;
+    }
+  }
+
+  void gc_mem_stats::fold_dead_process_counts(per_process_struct *p) {
+    perProcessList &list = cblk->process_struct_list;
+    for (per_process_struct *n = list.next(p); n && per_process_struct::is_marked(n); n = list.next(n)) {
+      n->fold_mutator_counts();
+      std::pair<std::size_t, std::size_t> counts = n->take_marked();
+      in_use_current += counts.first;
+      n_objects_current += counts.second;
+    }
+  }
+
   std::size_t gc_mem_stats::n_processes() const {
     return cblk->total_process_count.load().count;
   }
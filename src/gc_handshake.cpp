@@ -28,20 +28,38 @@
 #include <mutex>
 #include <cstdlib>
 #include <cstring>
+#include <cerrno>
 #include <memory>
 #include <vector>
+#include <climits>
+#include <ctime>
+
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 
 #include "mpgc/gc.h"
 #include "mpgc/write_barrier.h"
 
 namespace mpgc {
   extern void start_gc(Stage);
+  extern void start_marker_threads();
   extern void atexit_gc_handler();
   extern void assert_current_alloc_list_empty();
 
   namespace gc_handshake {
     per_process_struct *process_struct = nullptr;
     mark_bitmap *mbitmap = nullptr;
+    bool use_safepoints = false;
+    volatile bool publish_marks_eagerly = false;
+    /* How much of its stack, from the top, a thread scans itself at the
+     * async handshake. It copies up to snapshot_stack_words more, and the
+     * GC thread scans the copy (see scan_stack_snapshots()). The thread
+     * scans whatever lies beyond both itself, so that the copy, and the
+     * pause, stay bounded. Either being 0 scans the whole stack.
+     */
+    static std::size_t sync_stack_words = 0;
+    static std::size_t snapshot_stack_words = 0;
 
     thread_local thread_struct_handle thread_struct_handles;
     in_memory_thread_struct_list_type thread_struct_list;
@@ -57,8 +75,21 @@ namespace mpgc {
         * initialize it there after construction.
         */
        thread_struct_list.insert(handle);
+       /* Until the snapshot is mapped, the handler scans the whole stack.
+        * NORESERVE, as only as much as the stack reaches gets written.
+        */
+       if (sync_stack_words > 0 && snapshot_stack_words > 0) {
+         void *p = mmap(nullptr, snapshot_stack_words * sizeof(std::size_t), PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+         if (p != MAP_FAILED) {
+           handle->stack_snapshot = static_cast<std::size_t*>(p);
+           std::atomic_signal_fence(std::memory_order_release);
+           handle->stack_snapshot_capacity = snapshot_stack_words;
+         }
+       }
        // We must set status_idx only if we haven't received a signal by that time.
        handle->status_idx.compare_exchange_strong(expected_status, process_struct->get_gc_status());
+       notify_handshake_ack();
        handle->persist_data->slot = cb.bump_alloc_slots.acquire_slot();
     }
 
@@ -138,26 +169,53 @@ namespace mpgc {
       thread_struct.local_free_list.clear();
     }*/
 
-    void hdl_sync(Signum sig) {
-      in_memory_thread_struct &thread_struct = *thread_struct_handles.handle;
+    /* A signal handler may only publish the thread's staged marks if it
+     * didn't interrupt anything that adds to its mbuf or staging array.
+     */
+    static bool can_publish_marks(in_memory_thread_struct &thread_struct) {
+      return !thread_struct.mark_signal_disabled && !thread_struct.sweep_signal_disabled &&
+             !thread_struct.in_safepoint && thread_struct.blocked == Blocked::No;
+    }
+
+    /* The handshake actions take the thread they act for and the top of its
+     * stack, since the GC thread runs them itself for threads in a
+     * gc_blocked_region.
+     */
+    static void sync_thread(in_memory_thread_struct &thread_struct, Signum sig) {
       if (thread_struct.mark_signal_disabled) {
         thread_struct.mark_signal_requested = sig;
       } else if (thread_struct.status_idx.load().status() == Signum::sigInit) {
         thread_struct.status_idx = process_struct->get_gc_status();
       } else {
         assert(thread_struct.status_idx.load().index() == process_struct->global_list_index());
+        if (can_publish_marks(thread_struct)) {
+          thread_struct.publish_marks();
+        }
         thread_struct.status_idx = gc_status(sig, thread_struct.status_idx.load().index());
       }
-      return;
+      notify_handshake_ack();
     }
 
-    void hdl_async() {
-      in_memory_thread_struct &thread_struct = *thread_struct_handles.handle;
+    /* Copies as much of [from, end) as fits into thread_struct's
+     * stack_snapshot, and returns the end of what was copied.
+     */
+    static const std::size_t *snapshot_stack(in_memory_thread_struct &thread_struct,
+                                             const std::size_t *from, const std::size_t *end) {
+      const std::size_t words = std::min(std::size_t(end - from), thread_struct.stack_snapshot_capacity);
+      std::memcpy(thread_struct.stack_snapshot, from, words * sizeof(std::size_t));
+      thread_struct.stack_snapshot_words = words;
+      return from + words;
+    }
+
+    /* The colder frames may be snapshotted rather than scanned only when the
+     * thread itself runs the handshake.
+     */
+    static void async_thread(in_memory_thread_struct &thread_struct, const std::size_t *stack_top,
+                             bool snapshot_cold = false) {
       Signum sig = thread_struct.status_idx.load().status();
       if (sig == Signum::sigAsync) {
         return;
       }
-      void *stack_addr = nullptr;
 
       if (thread_struct.mark_signal_disabled) {
         thread_struct.mark_signal_requested = Signum::sigAsync;
@@ -165,16 +223,25 @@ namespace mpgc {
         thread_struct.status_idx = process_struct->get_gc_status();
       } else {
         assert(thread_struct.status_idx.load().index() == process_struct->global_list_index());
-        process_stack(thread_struct, reinterpret_cast<std::size_t*>(&stack_addr),
-                      reinterpret_cast<std::size_t*>(thread_struct.stack_end),
-                      mark_gray, thread_struct);
+        const std::size_t *stack_end = reinterpret_cast<std::size_t*>(thread_struct.stack_end);
+        if (snapshot_cold && thread_struct.stack_snapshot_capacity > 0 &&
+            std::size_t(stack_end - stack_top) > sync_stack_words) {
+          const std::size_t *cold = stack_top + sync_stack_words;
+          const std::size_t *copied = snapshot_stack(thread_struct, cold, stack_end);
+          process_stack(thread_struct, copied, stack_end, mark_gray, thread_struct);
+          stack_end = cold;
+        }
+        process_stack(thread_struct, stack_top, stack_end, mark_gray, thread_struct);
+        if (can_publish_marks(thread_struct)) {
+          thread_struct.publish_marks();
+        }
 
         thread_struct.status_idx = gc_status(Signum::sigAsync, thread_struct.status_idx.load().index());
       }
+      notify_handshake_ack();
     }
 
-    void hdl_sweep() {
-      in_memory_thread_struct &thread_struct = *thread_struct_handles.handle;
+    static void sweep_thread(in_memory_thread_struct &thread_struct, std::size_t *stack_top) {
       Signum sig = thread_struct.status_idx.load().status();
       //If we are already set, then just return back.
       if (sig == Signum::sigSweep) {
@@ -187,24 +254,290 @@ namespace mpgc {
       } else if (sig == Signum::sigInit) {
         thread_struct.status_idx = process_struct->get_gc_status();
       } else {
-        void *stack_addr = nullptr;
         assert(thread_struct.status_idx.load().index() != process_struct->global_list_index());
-        assert_current_alloc_list_empty();
 
         thread_struct.status_idx = gc_status(Signum::sigSweep, 1 - thread_struct.status_idx.load().index());
-        process_stack_weak_ptrs(thread_struct,
-                                reinterpret_cast<std::size_t*>(&stack_addr),
+        process_stack_weak_ptrs(thread_struct, stack_top,
                                 reinterpret_cast<std::size_t*>(thread_struct.stack_end));
         thread_struct.clear_local_allocator = true;
+        if (can_publish_marks(thread_struct)) {
+          thread_struct.publish_marks();
+        }
+      }
+      notify_handshake_ack();
+    }
+
+    void hdl_sync(Signum sig) {
+      sync_thread(*thread_struct_handles.handle, sig);
+    }
+
+    void hdl_async() {
+      void *stack_addr = nullptr;
+      async_thread(*thread_struct_handles.handle, reinterpret_cast<std::size_t*>(&stack_addr), true);
+    }
+
+    void hdl_sweep() {
+      void *stack_addr = nullptr;
+      assert_current_alloc_list_empty();
+      sweep_thread(*thread_struct_handles.handle, reinterpret_cast<std::size_t*>(&stack_addr));
+    }
+
+    /* Like process_stack(), except that the weak pointers on the stack may
+     * be changing under us, so a contingent pointer is taken as strong,
+     * whatever precedes it.
+     */
+    template <typename Fn>
+    void process_stack_snapshot(const std::size_t *start, const std::size_t *end, Fn&& func) {
+      while (start < end) {
+        if (base_offset_ptr::is_valid(reinterpret_cast<uint8_t*>(*start))) {
+          std::forward<Fn>(func)(offset_ptr<const gc_allocated>(
+            reinterpret_cast<const gc_allocated*>(*start)));
+        } else if (base_offset_ptr::could_be_offset_ptr(*start)) {
+          offset_ptr<const gc_allocated> &ptr =
+            reinterpret_cast<offset_ptr<const gc_allocated>&>(*const_cast<std::size_t*>(start));
+          offset_ptr<const gc_allocated> strong_ptr;
+          strong_ptr.remove_special_bits(ptr);
+          if (!ptr.is_weak() && strong_ptr.is_valid() && strong_ptr->get_gc_descriptor().is_valid()) {
+            std::forward<Fn>(func)(strong_ptr);
+          }
+        }
+        start++;
+      }
+    }
+
+    void scan_stack_snapshots(Traversal_queue &q) {
+      gc_control_block &cb = control_block();
+      for (in_memory_thread_struct *h = thread_struct_list.head(); h; h = thread_struct_list.next(h)) {
+        process_stack_snapshot(h->stack_snapshot, h->stack_snapshot + h->stack_snapshot_words,
+                               [&q, &cb](const offset_ptr<const gc_allocated> &p) {
+                                 if (!cb.bitmap.is_marked(p)) {
+                                   q.push(p);
+                                 }
+                               });
+        h->stack_snapshot_words = 0;
+      }
+    }
+
+    void hdl_flush() {
+      in_memory_thread_struct &thread_struct = *thread_struct_handles.handle;
+      if (can_publish_marks(thread_struct)) {
+        thread_struct.publish_marks();
+      } else {
+        // Let the GC ask again.
+        thread_struct.mark_flush_requested = false;
       }
     }
 
+    void request_mark_flush(in_memory_thread_struct &thread_struct) {
+      publish_marks_eagerly = true;
+      if (!thread_struct.marked_dead() && !thread_struct.mark_flush_requested.exchange(true)) {
+        pthread_sigqueue(thread_struct.pthread, SIGRTMIN, {.sival_int = static_cast<char>(Signum::sigFlush)});
+      }
+    }
+
+    bool handshake_blocked_thread(in_memory_thread_struct &thread_struct, Signum sig, bool requested) {
+      Blocked expected = Blocked::Yes;
+      if (!thread_struct.blocked.compare_exchange_strong(expected, Blocked::Handshaking)) {
+        return false;
+      }
+      Signum expected_sig = sig;
+      if (requested && !thread_struct.safepoint_requested.compare_exchange_strong(expected_sig, Signum::sigInit)) {
+        thread_struct.blocked = Blocked::Yes;
+        return false;
+      }
+      switch (sig) {
+      case Signum::sigSync1:
+      case Signum::sigSync2:
+        sync_thread(thread_struct, sig);
+        break;
+      case Signum::sigAsync:
+        async_thread(thread_struct, thread_struct.blocked_stack_top);
+        break;
+      case Signum::sigSweep:
+        sweep_thread(thread_struct, thread_struct.blocked_stack_top);
+        break;
+      default:
+        std::abort();
+      }
+      thread_struct.publish_marks();
+      thread_struct.blocked = Blocked::Yes;
+      return true;
+    }
+
+    //Handles a deferred mark handshake as write_barrier_epilogue() does.
+    void publish_marks_deferring_handshakes(in_memory_thread_struct &thread_struct) {
+      thread_struct.mark_signal_disabled = true;
+      std::atomic_signal_fence(std::memory_order_release);
+      thread_struct.publish_marks();
+      std::atomic_signal_fence(std::memory_order_release);
+      thread_struct.mark_signal_disabled = false;
+      switch (thread_struct.mark_signal_requested) {
+      case Signum::sigSync1:
+      case Signum::sigSync2:
+        thread_struct.status_idx = gc_status(thread_struct.mark_signal_requested,
+                                             thread_struct.status_idx.load().index());
+        notify_handshake_ack();
+        break;
+      case Signum::sigAsync:
+        do_deferred_async_signal(thread_struct);
+      default: break;
+      }
+      thread_struct.mark_signal_requested = Signum::sigInit;
+    }
+
+    /* Out of line so that its frame lies below everything the caller may
+     * keep on the stack during the region.
+     */
+    __attribute__((noinline))
+    void enter_blocked_region(in_memory_thread_struct &thread_struct) {
+      assert(thread_struct.blocked == Blocked::No);
+      assert(!thread_struct.mark_signal_disabled && !thread_struct.sweep_signal_disabled);
+      safepoint_poll(thread_struct);
+      publish_marks_deferring_handshakes(thread_struct);
+      thread_struct.blocked_stack_top = static_cast<std::size_t*>(__builtin_frame_address(0));
+      thread_struct.blocked = Blocked::Yes;
+    }
+
+    void leave_blocked_region(in_memory_thread_struct &thread_struct) {
+      Blocked expected = Blocked::Yes;
+      while (!thread_struct.blocked.compare_exchange_weak(expected, Blocked::No)) {
+        expected = Blocked::Yes;
+        std::cpu_relax();
+      }
+      safepoint_poll(thread_struct);
+    }
+
+    std::atomic<uint32_t> handshake_ack_word(0);
+    std::atomic<bool> handshake_ack_waiting(false);
+
+    //Called from signal handlers, so it must stay async-signal-safe.
+    void wake_handshake_waiter() {
+      handshake_ack_word.fetch_add(1);
+      syscall(SYS_futex, &handshake_ack_word, FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+    }
+
+    static bool acknowledged(in_memory_thread_struct *h, Signum sig, bool doWeakCheck) {
+      return h->marked_dead() || (h->status_idx.load().status() == sig &&
+                                  !(doWeakCheck && h->weak_signal == Weak_signal::DoHandshake));
+    }
+
+    /* Signals the threads that still haven't taken the safepoint request
+     * for sig, once per wait.
+     */
+    static void signal_late_threads(Signum sig, bool doWeakCheck) {
+      sigval_t sigval;
+      sigval.sival_int = static_cast<char>(sig);
+      for (in_memory_thread_struct *h = thread_struct_list.head(); h; h = thread_struct_list.next(h)) {
+        if (!acknowledged(h, sig, doWeakCheck) && h->safepoint_requested == sig) {
+          pthread_sigqueue(h->pthread, SIGRTMIN, sigval);
+        }
+      }
+    }
+
+    static std::int64_t thread_cpu_ns() {
+      timespec ts;
+      clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+      return std::int64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+    }
+
+    void wait_handshake(Signum sig, bool doWeakCheck) {
+      static const std::size_t spin_limit = ruts::env_value<std::size_t>("MPGC_GC_HANDSHAKE_SPIN", 4096);
+      static const std::int64_t safepoint_deadline_ns =
+        ruts::env_value<std::int64_t>("MPGC_GC_SAFEPOINT_DEADLINE_US", 1000) * 1000;
+      /* Anything that can hold up an acknowledgement without calling
+       * notify_handshake_ack(), like request_gc_termination, is seen
+       * within this long.
+       */
+      static const timespec max_sleep = {0, 1000000};
+      const std::int64_t start_ns = gc_mem_stats::now_ns();
+      const std::int64_t start_cpu_ns = thread_cpu_ns();
+      std::size_t spins = 0;
+      bool signalled = !use_safepoints;
+
+      in_memory_thread_struct *h = thread_struct_list.head();
+      while (h && !request_gc_termination) {
+        if (acknowledged(h, sig, doWeakCheck)) {
+          h = thread_struct_list.next(h);
+        } else if (use_safepoints && h->blocked == Blocked::Yes &&
+                   handshake_blocked_thread(*h, sig, true)) {
+          // It entered a gc_blocked_region after the handshake was posted.
+        } else if (spins < spin_limit) {
+          spins++;
+          std::cpu_relax();
+        } else {
+          /* The deadline is only checked between sleeps, so late threads
+           * are signalled up to max_sleep after it passes.
+           */
+          if (!signalled && gc_mem_stats::now_ns() - start_ns >= safepoint_deadline_ns) {
+            signal_late_threads(sig, doWeakCheck);
+            signalled = true;
+          }
+          /* Announce the wait before taking the word and checking again,
+           * so that a thread that acknowledges after the check sees it
+           * and changes the word, and the futex doesn't sleep.
+           */
+          handshake_ack_waiting = true;
+          const uint32_t word = handshake_ack_word;
+          if (!acknowledged(h, sig, doWeakCheck)) {
+            syscall(SYS_futex, &handshake_ack_word, FUTEX_WAIT_PRIVATE, word, &max_sleep, nullptr, 0);
+          }
+          handshake_ack_waiting = false;
+        }
+      }
+      control_block().mem_stats.handshake_waited(gc_mem_stats::now_ns() - start_ns,
+                                                 thread_cpu_ns() - start_cpu_ns);
+    }
+
     void hdl_abrt(int sig, siginfo_t *siginfo, void *context) {
       pthread_kill(pthread_self(), SIGSTOP);
     }
 
-    void signal_hdl(int sig, siginfo_t *siginfo, void *context) {
+    /* Runs the handshakes posted to this thread in safepoint mode. It is
+     * kept out of line so that __builtin_unwind_init() spills the callee
+     * saved registers into its frame, where hdl_async() scans them just
+     * like the signal frame in signal mode.
+     */
+    __attribute__((noinline))
+    void run_safepoint(in_memory_thread_struct &thread_struct) {
+      __builtin_unwind_init();
+      do {
+        thread_struct.in_safepoint = true;
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        Signum sig = thread_struct.safepoint_requested.exchange(Signum::sigInit);
+        switch (sig) {
+        case Signum::sigSync1:
+        case Signum::sigSync2:
+          hdl_sync(sig);
+          break;
+        case Signum::sigAsync:
+          hdl_async();
+          break;
+        case Signum::sigSweep:
+          hdl_sweep();
+          break;
+        default:
+          break;
+        }
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        thread_struct.in_safepoint = false;
+      } while (thread_struct.safepoint_requested.load(std::memory_order_relaxed) != Signum::sigInit);
+    }
+
+    static void dispatch_signal(siginfo_t *siginfo) {
 #define SIGNUM_TO_INT(x) static_cast<char>(x)
+      Signum signum = static_cast<Signum>(siginfo->si_value.sival_int);
+      if (use_safepoints && signum != Signum::sigDeferredAsync && signum != Signum::sigDeferredSweep &&
+          signum != Signum::sigFlush) {
+        in_memory_thread_struct &thread_struct = *thread_struct_handles.handle;
+        /* A deadline signal is only acted on if the request is still
+         * pending. Otherwise the thread has taken it at a safepoint, and
+         * the GC may have moved on to the next handshake.
+         */
+        if (thread_struct.in_safepoint ||
+            !thread_struct.safepoint_requested.compare_exchange_strong(signum, Signum::sigInit)) {
+          return;
+        }
+      }
       switch(siginfo->si_value.sival_int) {
       case SIGNUM_TO_INT(Signum::sigSync1):
        hdl_sync(Signum::sigSync1);
@@ -220,12 +553,24 @@ namespace mpgc {
       case SIGNUM_TO_INT(Signum::sigDeferredSweep):
        hdl_sweep();
        break;
+      case SIGNUM_TO_INT(Signum::sigFlush):
+       hdl_flush();
+       break;
       default:
        std::abort();
       }
 #undef SIGNUM_TO_INT
     }
 
+    /* The handshakes may make system calls (futex() to wake the GC thread,
+     * for one), which must not clobber the errno of the code interrupted.
+     */
+    void signal_hdl(int sig, siginfo_t *siginfo, void *context) {
+      const int saved_errno = errno;
+      dispatch_signal(siginfo);
+      errno = saved_errno;
+    }
+
     // intiailize1() is only called from mpgc::initialize().  It only be
     // called once.  initialize2() is called once per thread.
     void initialize1() {
@@ -238,6 +583,9 @@ namespace mpgc {
       act.sa_flags = SA_SIGINFO | SA_RESTART;
 
       /* Use the sa_sigaction field because the handles has two additional parameters */
+      use_safepoints = ruts::env_flag("MPGC_GC_SAFEPOINTS");
+      sync_stack_words = ruts::env_value<std::size_t>("MPGC_GC_SYNC_STACK_KB", 64) * 1024 / sizeof(std::size_t);
+      snapshot_stack_words = ruts::env_value<std::size_t>("MPGC_GC_STACK_SNAPSHOT_KB", 256) * 1024 / sizeof(std::size_t);
       act.sa_sigaction = &signal_hdl;
       if (sigaction(SIGRTMIN, &act, NULL) < 0) {
         std::abort();
@@ -280,6 +628,8 @@ namespace mpgc {
 
       //Create inbound pointer table before GC thread
       inbound_pointers::inbound_table::table(true);
+      //Create the marker threads which help the GC thread to mark
+      start_marker_threads();
       //Create a GC thread which will do the GC work
       static std::thread gc_thread(start_gc, stage);
       gc_thread.detach();
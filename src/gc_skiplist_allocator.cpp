@@ -31,10 +31,9 @@
 
 namespace mpgc {
   extern void global_allocation_epilogue(gc_control_block&, gc_handshake::in_memory_thread_struct&);
+  extern bool mutator_sweep(gc_control_block&, gc_handshake::in_memory_thread_struct&);
 
   namespace gc_allocator {
-    std::atomic<std::size_t> skip_node::n_skip_nodes{0};
-
       bool skiplist::_help_unfinished_bump_alloc(gc_control_block &cb,
                                                  bump_chunk &exp,
                                                  bump_chunk &exp1,
@@ -149,8 +148,15 @@ namespace mpgc {
              cb.global_free_lists[tstruct.status_idx.load().index()].allocate(cb, tstruct.persist_data->slot,
                                                                               req_size, max_size, tstruct.rand);
         if (c) {
+          cb.mem_stats.allocated(c->size() << 3);
           return c;
         }
+        //Sweep a chunk ourselves if the GC hasn't got to all of them yet.
+        if (mutator_sweep(cb, tstruct)) {
+          continue;
+        }
+        //Nothing big enough is left, so don't wait for the pacer.
+        cb.mem_stats.request_cycle();
         global_allocation_epilogue(cb, tstruct);
       } while (true);
       return nullptr;
@@ -172,33 +178,16 @@ namespace mpgc {
     get_from_local(std::size_t size, std::size_t algn,
                    localPoolType &local_chunks)
     {
-      localPoolType::iterator end = local_chunks.end();
-      for (localPoolType::iterator it = local_chunks.lower_bound(size);
-           it != end;
-           it++)
-        {
-          std::size_t chunk_size = it->first;
-          bool first_time = true;
-          for (local_chunk **ppChunk = &(it->second);
-               *ppChunk != nullptr;
-               ppChunk = &(*ppChunk)->next())
-            {
-              local_chunk *chunk = (*ppChunk);
-              std::size_t padding = required_padding(chunk, algn);
-              if (size+padding <= chunk_size) {
-                local_chunk *next = chunk->next();
-              
-                (*ppChunk) = next;
-                if (first_time && next == nullptr) {
-                  local_chunks.erase(it);
-                }
-                first_time = false;
-                std::size_t leftover_size = chunk_size - size - padding;
-                return std::make_tuple(chunk, leftover_size, padding);
-              }
-            }
-        }
-      return std::make_tuple(nullptr, 0, 0);
+      // As in get_from_global(), ask for enough to cover any padding
+      // rather than searching for a chunk that happens to be aligned.
+      std::size_t max_padding = algn-1;
+      local_chunk *chunk = local_chunks.get(size+max_padding);
+      if (chunk == nullptr) {
+        return std::make_tuple(nullptr, 0, 0);
+      }
+      std::size_t padding = required_padding(chunk, algn);
+      std::size_t leftover_size = chunk->size() - size - padding;
+      return std::make_tuple(chunk, leftover_size, padding);
     }
 
     inline
@@ -223,13 +212,48 @@ namespace mpgc {
                       localPoolType &local_chunks)
     {
       if (size >= (sizeof(local_chunk) >> alignment_log)) {
-        local_chunk*& temp = local_chunks[size];
-        temp = new (p) local_chunk(size, temp);
+        local_chunks.put(new (p) local_chunk(size, nullptr));
       } else if (size > 0){
         *p = size;
       }
     }
 
+    /*
+     * Retires the remainder of the thread's tlab to the local free list and
+     * replaces it with a fresh region of tlab::refill_size words, taken whole
+     * from the local free list if one is big enough. Otherwise the region
+     * only has to hold the size words being allocated: it then comes from a
+     * smaller local chunk, or from the global free list (which hands out up
+     * to slab_size words), so that a fragmented heap can't leave the thread
+     * waiting for a run of refill_size words that no cycle will produce.
+     */
+    inline
+    void refill_tlab(gc_handshake::in_memory_thread_struct &tstruct, std::size_t size) {
+      localPoolType &local_chunks = tstruct.local_free_list;
+      std::size_t *old_top;
+      std::size_t old_size;
+      std::tie(old_top, old_size) = tstruct.tlab.reset();
+      put_to_local(old_top, old_size, local_chunks);
+
+      local_chunk *chunk;
+      std::size_t leftover_size;
+      std::size_t pad_size;
+      std::tie(chunk, leftover_size, pad_size)
+        = get_from_local(tlab::refill_size, 1, local_chunks);
+      if (chunk != nullptr) {
+        size = tlab::refill_size;
+      } else {
+        std::tie(chunk, leftover_size, pad_size)
+          = get_from_local(size, 1, local_chunks);
+      }
+      if (chunk == nullptr) {
+        std::tie(chunk, leftover_size, pad_size)
+          = get_from_global(size, 1, tstruct);
+      }
+      std::size_t *begin = reinterpret_cast<std::size_t*>(chunk);
+      tstruct.tlab.reset(begin, begin + size + leftover_size);
+    }
+
     void* alloc (gc_handshake::in_memory_thread_struct &tstruct,
                  std::size_t size,
                  std::size_t req_alignment)
@@ -241,6 +265,14 @@ namespace mpgc {
       size = align_size_up(size, alignment) >> alignment_log;
       req_alignment = align_size_up(req_alignment, alignment) >> alignment_log;
       localPoolType &local_chunks = tstruct.local_free_list;
+      if (req_alignment == 1 && size <= tlab::max_object_size) {
+        void *p = tstruct.tlab.allocate_words(size);
+        if (p == nullptr) {
+          refill_tlab(tstruct, size);
+          p = tstruct.tlab.allocate_words(size);
+        }
+        return p;
+      }
       std::tie(chunk, leftover_size, pad_size)
         = get_from_local(size, req_alignment, local_chunks);
       if (chunk == nullptr) {
@@ -24,9 +24,16 @@
  *
  */
 
+#include <chrono>
 #include <condition_variable>
+#include <thread>
 #include <unordered_map>
 
+#include <sys/mman.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
 #include "mpgc/gc_handshake.h"
 #include "mpgc/gc_thread.h"
 #include "mpgc/weak_ctrl_map.h"
@@ -70,6 +77,13 @@ namespace mpgc {
    * sweep to progress, and will loop forever in the global allocator.
    */
   void global_allocation_epilogue(gc_control_block& cb, gc_handshake::in_memory_thread_struct& thread_struct) {
+    /* The thread may wait here for a cycle to free memory, and the GC won't
+     * finish marking while it has staged marks, which a signal handler
+     * won't publish while the sweep signal is disabled.
+     */
+    if (thread_struct.persist_data->n_mark_staged > 0) {
+      gc_handshake::publish_marks_deferring_handshakes(thread_struct);
+    }
     /* We should continue to defer sweep signal until allocation_epilogue() is invoked.
      * This is to avoid any race that may arise otherwise.
      */
@@ -83,6 +97,7 @@ namespace mpgc {
     if (thread_struct.clear_local_allocator) {
       thread_struct.clear_local_allocator = false;
       thread_struct.local_free_list.clear();
+      thread_struct.tlab.clear();
     }
     /*
      * We had the worker threads performing sweep1, but we were seeing
@@ -100,6 +115,33 @@ namespace mpgc {
     // }
   }
 
+  /*
+   * Called by an allocating thread that found the global free list empty.
+   * While the GC thread has the sweep2 phase open (sweep2_enabled), the
+   * thread sweeps one unclaimed logical chunk into its free list and
+   * returns true, so that the caller retries the allocation. Unlike sweep1
+   * above, this is safe: the GC thread clears sweep2_enabled and then waits
+   * for lazy_sweepers to drop to zero before it moves on, so no chunk can
+   * be swept after its bitmaps have been cleared.
+   */
+  bool mutator_sweep(gc_control_block &cb, gc_handshake::in_memory_thread_struct &thread_struct) {
+    per_process_struct &ps = *gc_handshake::process_struct;
+    if (!ps.sweep2_enabled.load(std::memory_order_relaxed)) {
+      return false;
+    }
+    ps.lazy_sweepers++;
+    bool swept = false;
+    if (ps.sweep2_enabled) {
+      const uint8_t idx = thread_struct.status_idx.load().index();
+      assert(idx == ps.global_list_index());
+      swept = cb.bitmap.sweep_unclaimed_chunk(cb, cb.global_free_lists[idx],
+                                              thread_struct.persist_data->expansion_slot,
+                                              thread_struct.rand, idx);
+    }
+    ps.lazy_sweepers--;
+    return swept;
+  }
+
   /*
    * This function is called before allocation to defer sweep signal.
    */
@@ -108,11 +150,13 @@ namespace mpgc {
     initialize_thread();
 
     gc_handshake::in_memory_thread_struct &thread_struct = *gc_handshake::thread_struct_handles.handle;
+    gc_handshake::safepoint_poll(thread_struct);
     thread_struct.sweep_signal_disabled = true;
 
     if (thread_struct.clear_local_allocator) {
       thread_struct.clear_local_allocator = false;
       thread_struct.local_free_list.clear();
+      thread_struct.tlab.clear();
     }
     return thread_struct;
   }
@@ -164,13 +208,19 @@ namespace mpgc {
     if (thread_struct.status_idx.load().status() == gc_handshake::Signum::sigAsync) {
       cb.bitmap.mark_begin_first(ptr);
     }
-    cb.mem_stats.marked(ptr);
+    thread_struct.persist_data->count_marked(ptr->get_gc_descriptor().object_size() * 8, 1);
 
     /* We need the following signal_fence because sweep signal *must* not be
      * enabled (or processed) before marking, if we are in async phase.
      */
     std::atomic_signal_fence(std::memory_order_release);
 
+    /* Publish the marks staged before and during the allocation, which the
+     * GC may have asked for meanwhile, while the sweep signal is disabled.
+     */
+    if (thread_struct.persist_data->n_mark_staged > 0) {
+      gc_handshake::publish_marks_deferring_handshakes(thread_struct);
+    }
     //Enable sweep signal, and process if already pending.
     thread_struct.sweep_signal_disabled = false;
     if (thread_struct.sweep_signal_requested) {
@@ -179,6 +229,201 @@ namespace mpgc {
     }
   }
 
+  /*
+   * Batch version of allocation_epilogue() for n non-array objects of
+   * object_size words each, laid out contiguously from p. The fences,
+   * the status check and the black-allocation marking are done once for
+   * the whole batch.
+   */
+  void allocation_epilogue_n(gc_handshake::in_memory_thread_struct& thread_struct, void *p,
+                             gc_token &tok, std::size_t n, std::size_t object_size) {
+
+    assert(thread_struct.status_idx.load().status() != gc_handshake::Signum::sigInit);
+    gc_control_block &cb = control_block();
+    std::size_t * const begin = static_cast<std::size_t*>(p);
+
+    /* alloc() left the size of the whole region in its first word. Give
+     * every other object its own size before any gc_descriptor appears, so
+     * that after a crash the region can still be walked object by object.
+     * There is no array size to store; alloc() zeroed the rest.
+     */
+    for (std::size_t i = 1; i < n; i++) {
+      begin[i * object_size] = object_size;
+    }
+    std::atomic_signal_fence(std::memory_order_release);
+
+    for (std::size_t i = 0; i < n; i++) {
+      new (begin + i * object_size) gc_allocated(gc_allocated::only_allocation_epilogue{}, tok);
+    }
+    //See allocation_epilogue() for the fences and the marking order.
+    std::atomic_signal_fence(std::memory_order_release);
+
+    if (thread_struct.status_idx.load().status() == gc_handshake::Signum::sigAsync) {
+      for (std::size_t i = 0; i < n; i++) {
+        cb.bitmap.mark_begin_first(reinterpret_cast<const gc_allocated*>(begin + i * object_size));
+      }
+    }
+    thread_struct.persist_data->count_marked(n * object_size * 8, n);
+
+    std::atomic_signal_fence(std::memory_order_release);
+
+    if (thread_struct.persist_data->n_mark_staged > 0) {
+      gc_handshake::publish_marks_deferring_handshakes(thread_struct);
+    }
+    thread_struct.sweep_signal_disabled = false;
+    if (thread_struct.sweep_signal_requested) {
+      thread_struct.sweep_signal_requested = false;
+      gc_handshake::do_deferred_sweep_signal(thread_struct);
+    }
+  }
+
+  void mark_bitmap::zero(atomic_rep_t *p, std::size_t n) {
+    /* Below this size a memset is cheaper than the system call and the
+     * TLB shootdown that comes with it.
+     */
+    constexpr std::size_t min_punch_bytes = 1 << 16;
+    static std::atomic<bool> punch_supported(true);
+
+    uint8_t *begin = reinterpret_cast<uint8_t*>(p);
+    uint8_t *end = begin + n * sizeof(atomic_rep_t);
+    static const std::size_t page = sysconf(_SC_PAGESIZE);
+    uint8_t *page_begin = reinterpret_cast<uint8_t*>(
+        gc_allocator::align_size_up(reinterpret_cast<std::size_t>(begin), page));
+    uint8_t *page_end = reinterpret_cast<uint8_t*>(reinterpret_cast<std::size_t>(end) & ~(page - 1));
+
+    if (page_end > page_begin
+        && std::size_t(page_end - page_begin) >= min_punch_bytes
+        && punch_supported.load(std::memory_order_relaxed)) {
+      /* MADV_REMOVE frees the backing store of a shared file mapping, after
+       * which the range reads as zero in every process that maps it. Not all
+       * file systems support it, in which case we fall back to memset.
+       */
+      if (madvise(page_begin, page_end - page_begin, MADV_REMOVE) == 0) {
+        std::memset(begin, 0x0, page_begin - begin);
+        std::memset(page_end, 0x0, end - page_end);
+        return;
+      }
+      punch_supported.store(false, std::memory_order_relaxed);
+    }
+    std::memset(begin, 0x0, end - begin);
+  }
+
+  /*
+   * Scalar kernels for mark_bitmap::skip_zero_words(). Four words are OR-ed
+   * together per step so that a zero run costs one branch per 256 bits.
+   */
+  static std::size_t skip_zero_words_scalar(const std::size_t *bits, std::size_t idx,
+                                            const std::size_t end_idx, const uint8_t sl) {
+    while (idx + 4 <= end_idx
+           && (bits[idx << sl] | bits[(idx + 1) << sl] | bits[(idx + 2) << sl] | bits[(idx + 3) << sl]) == 0) {
+      idx += 4;
+    }
+    while (idx < end_idx && bits[idx << sl] == 0) {
+      idx++;
+    }
+    return idx;
+  }
+
+  //Returns one past the last non-zero word below idx, or 0.
+  static std::size_t skip_zero_words_back_scalar(const std::size_t *bits, std::size_t idx, const uint8_t sl) {
+    while (idx >= 4
+           && (bits[(idx - 1) << sl] | bits[(idx - 2) << sl] | bits[(idx - 3) << sl] | bits[(idx - 4) << sl]) == 0) {
+      idx -= 4;
+    }
+    while (idx > 0 && bits[(idx - 1) << sl] == 0) {
+      idx--;
+    }
+    return idx;
+  }
+
+#if defined(__x86_64__)
+  /*
+   * AVX2 kernels: look at 512 bits of bitmap per step, and find the first
+   * (last) non-zero word within it from a lane mask. With the interleaved
+   * layout (sl == 1) only the even lanes belong to the bitmap being scanned,
+   * so each step covers 256 bits of it. The scalar kernels do the tail.
+   */
+  __attribute__((target("avx2")))
+  static inline unsigned non_zero_lanes(const std::size_t *p, const uint8_t sl) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i *v = reinterpret_cast<const __m256i*>(p);
+    unsigned lo = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(_mm256_loadu_si256(v), zero)));
+    unsigned hi = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(_mm256_loadu_si256(v + 1), zero)));
+    return ~(lo | (hi << 4)) & (sl == 0 ? 0xff : 0x55);
+  }
+
+  __attribute__((target("avx2")))
+  static std::size_t skip_zero_words_avx2(const std::size_t *bits, std::size_t idx,
+                                          const std::size_t end_idx, const uint8_t sl) {
+    const std::size_t step = 8 >> sl;
+    for (; idx + step <= end_idx; idx += step) {
+      unsigned m = non_zero_lanes(bits + (idx << sl), sl);
+      if (m != 0) {
+        return idx + (__builtin_ctz(m) >> sl);
+      }
+    }
+    return skip_zero_words_scalar(bits, idx, end_idx, sl);
+  }
+
+  __attribute__((target("avx2")))
+  static std::size_t skip_zero_words_back_avx2(const std::size_t *bits, std::size_t idx, const uint8_t sl) {
+    const std::size_t step = 8 >> sl;
+    for (; idx >= step; idx -= step) {
+      unsigned m = non_zero_lanes(bits + ((idx - step) << sl), sl);
+      if (m != 0) {
+        return idx - step + ((31 - __builtin_clz(m)) >> sl) + 1;
+      }
+    }
+    return skip_zero_words_back_scalar(bits, idx, sl);
+  }
+
+  static const bool have_avx2 = [] {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") != 0;
+  }();
+#endif
+
+  /*
+   * The words are read non-atomically, as zero() already writes them. A
+   * word that becomes non-zero just after we skip it is no different from
+   * one that is set just after lookup_*() reads it.
+   */
+  bool mark_bitmap::has_scan_kernel(const scan_kernel kernel) {
+#if defined(__x86_64__)
+    return kernel != scan_kernel::avx2 || have_avx2;
+#else
+    return kernel != scan_kernel::avx2;
+#endif
+  }
+
+  mark_bitmap::bitmap_idx_t mark_bitmap::skip_zero_words(const atomic_rep_t *bits, bitmap_idx_t idx,
+                                                         const bitmap_idx_t end_idx, const uint8_t stride_log,
+                                                         const scan_kernel kernel) {
+    assert(has_scan_kernel(kernel));
+    const rep_t *words = reinterpret_cast<const rep_t*>(bits);
+#if defined(__x86_64__)
+    if (kernel == scan_kernel::avx2 || (kernel == scan_kernel::best && have_avx2)) {
+      return skip_zero_words_avx2(words, idx, end_idx, stride_log);
+    }
+#endif
+    return skip_zero_words_scalar(words, idx, end_idx, stride_log);
+  }
+
+  mark_bitmap::bitmap_idx_t mark_bitmap::skip_zero_words_back(const atomic_rep_t *bits, bitmap_idx_t idx,
+                                                              const uint8_t stride_log,
+                                                              const scan_kernel kernel) {
+    assert(has_scan_kernel(kernel));
+    const rep_t *words = reinterpret_cast<const rep_t*>(bits);
+#if defined(__x86_64__)
+    if (kernel == scan_kernel::avx2 || (kernel == scan_kernel::best && have_avx2)) {
+      idx = skip_zero_words_back_avx2(words, idx, stride_log);
+      return idx == 0 ? no_idx : idx - 1;
+    }
+#endif
+    idx = skip_zero_words_back_scalar(words, idx, stride_log);
+    return idx == 0 ? no_idx : idx - 1;
+  }
+
   void mark_bitmap::mark_gc_control_block() {
     //For this to work gc_control_block must be the first thing on the heap.
     _mark_end_first(0, (sizeof(gc_control_block) >> 3) - 1);
@@ -215,17 +460,21 @@ namespace mpgc {
     cb.bitmap.mark_gc_control_block();
   }
   /*
-   * The main function that marks black an object. It enumerates all
-   * the pointers in the object and then marks it.
+   * Objects marked by the GC and marker threads, flushed to the process
+   * struct whenever a thread is done emptying its queue.
    */
-  static void mark_black(const offset_ptr<const gc_allocated> &p, gc_control_block &cb, Traversal_queue &q) {
-    if (!p.is_valid() || cb.bitmap.is_marked(p) || !p->get_gc_descriptor().is_valid()) {
-      return;
-    }
+  static thread_local mark_counter gc_marked_counts;
 
+  /*
+   * Enumerates pointers one at a time, handling weak and contingent
+   * pointers, and pushes the unmarked ones on the queue. for_each calls
+   * its argument for each pointer to be processed.
+   */
+  template <typename ForEach>
+  static void mark_black_refs(gc_control_block &cb, Traversal_queue &q, ForEach &&for_each) {
     offset_ptr<const gc_allocated> last_ctrl = nullptr;
     bool last_ctrl_marked = false;
-    p->get_gc_descriptor().for_each_ref([&q, &cb, &last_ctrl, &last_ctrl_marked](const base_offset_ptr *base_ptr) {
+    for_each([&q, &cb, &last_ctrl, &last_ctrl_marked](const base_offset_ptr *base_ptr) {
       offset_ptr<const gc_allocated> ptr = *base_ptr;
       if (!ptr.is_null()) {
         assert(ptr.is_valid());
@@ -272,6 +521,70 @@ namespace mpgc {
       }
       last_ctrl = nullptr;
     });
+  }
+
+  /*
+   * Scans the elements of an array covered by a chunk reference. The
+   * array itself has already been marked by whoever pushed the chunk.
+   */
+  static void mark_array_chunk(const offset_ptr<const gc_allocated> &c, gc_control_block &cb, Traversal_queue &q) {
+    const offset_ptr<const gc_allocated> array = array_chunk_ref::array(c);
+    const gc_descriptor &desc = array->get_gc_descriptor();
+    const std::size_t chunk_len = array_chunk_ref::chunk_length(desc);
+    const std::size_t from = array_chunk_ref::chunk(c) * chunk_len;
+    const std::size_t to = std::min(from + chunk_len, desc.array_length());
+    assert(chunk_len > 0 && from < to);
+    mark_black_refs(cb, q, [&desc, from, to](auto &&fn) {
+        desc.for_each_array_ref(from, to, fn);
+      });
+  }
+
+  /*
+   * The main function that marks black an object. It enumerates all
+   * the pointers in the object and then marks it.
+   *
+   * For a large array, it only scans the first chunk of elements and
+   * pushes the rest of the chunks on the queue, to be scanned by
+   * whoever pops or steals them.
+   */
+  static void mark_black(const offset_ptr<const gc_allocated> &p, gc_control_block &cb, Traversal_queue &q) {
+    if (array_chunk_ref::is_chunk(p)) {
+      mark_array_chunk(p, cb, q);
+      return;
+    }
+    if (!p.is_valid() || cb.bitmap.is_marked(p) || !p->get_gc_descriptor().is_valid()) {
+      return;
+    }
+    const gc_descriptor &desc = p->get_gc_descriptor();
+
+    /*
+     * Fast path for objects with a compact descriptor and no
+     * special pointers: gather all the references at once and test their
+     * mark bits in bulk.
+     */
+    offset_ptr<const gc_allocated> refs[gc_descriptor::max_gathered_refs];
+    std::size_t nr_refs;
+    std::size_t chunk_len;
+    if (desc.gather_refs(refs, nr_refs)) {
+      nr_refs = cb.bitmap.filter_unmarked(refs, nr_refs);
+      for (std::size_t i = 0; i < nr_refs; i++) {
+        assert(refs[i].is_valid() && refs[i]->get_gc_descriptor().is_valid());
+        q.push(refs[i]);
+      }
+    } else if (desc.is_array() && (chunk_len = array_chunk_ref::chunk_length(desc)) > 0) {
+      const std::size_t len = desc.array_length();
+      for (std::size_t c = 1; c * chunk_len < len; c++) {
+        q.push(array_chunk_ref::make(p, c));
+      }
+      mark_black_refs(cb, q, [&desc, chunk_len](auto &&fn) {
+          desc.for_each_array_ref(0, chunk_len, fn);
+        });
+    } else {
+      mark_black_refs(cb, q, [&desc](auto &&fn) {
+          desc.for_each_ref(fn);
+        });
+    }
+
     /*
      * We mark end-bitmap first so that in case we crash before marking begin-bitmap,
      * the object is not considered marked, and whichever process takes over the
@@ -289,13 +602,7 @@ namespace mpgc {
     //  cb.bitmap.clear_control_mark(p);
    // }
 
-    /*
-     * We should probably do this in the per-process struct and sweep
-     * the total into the global when we try to increment the cycle
-     * number, but that's more bookkeeping and it might be more work
-     * to get the reference to the per-process struct.
-     */
-    cb.mem_stats.marked(p);
+    gc_marked_counts.count(p);
   }
 
   /*
@@ -317,27 +624,194 @@ namespace mpgc {
     p.set_barrier_incremented();
   }
 
+  /*
+   * Additional marker threads (MPGC_GC_MARKER_THREADS in total per
+   * process, including the GC thread). While marking_phase() is running
+   * they steal work from the traversal queues of their own process
+   * into their own queues and mark it. They take no part in
+   * the barriers: instead, the GC thread doesn't consider its queue empty
+   * until none of them holds any work. A marker counts itself in
+   * busy_markers before it tries to steal and stays counted until its
+   * queue is empty, so the count can't drop to zero while any of them
+   * still has work. A marker that finds nothing to steal parks on
+   * work_offered, counted in parked_markers, until some marker (the GC
+   * thread included) has enough queued to share (see offer_work()).
+   */
+  static std::atomic<bool> marking_active{false};
+  static std::atomic<std::size_t> busy_markers{0};
+  static std::atomic<bool> markers_worked{false};
+  static std::size_t running_markers = 0;
+  static std::atomic<std::size_t> parked_markers{0};
+  //What a marker must have queued to wake the parked ones.
+  static constexpr std::size_t min_offered_work = 16;
+  static std::size_t work_offers = 0;
+  static std::mutex marking_active_mutex;
+  static std::condition_variable marking_activated;
+  static std::condition_variable work_offered;
+  static std::condition_variable marker_stopped;
+
+  static void set_marking_active(bool active) {
+    {
+      std::lock_guard<std::mutex> lk(marking_active_mutex);
+      marking_active = active;
+    }
+    if (active) {
+      marking_activated.notify_all();
+    } else {
+      work_offered.notify_all();
+    }
+  }
+
+  //Wakes the parked markers. They are no longer counted once woken this way.
+  static void offer_work() {
+    {
+      std::lock_guard<std::mutex> lk(marking_active_mutex);
+      if (parked_markers == 0) {
+        return;
+      }
+      parked_markers = 0;
+      work_offers++;
+    }
+    work_offered.notify_all();
+  }
+
+  static void park_marker() {
+    std::unique_lock<std::mutex> lk(marking_active_mutex);
+    const std::size_t offers = work_offers;
+    parked_markers++;
+    work_offered.wait(lk, [offers]{return work_offers != offers || !marking_active || request_gc_termination;});
+    if (work_offers == offers) {
+      parked_markers--;
+    }
+  }
+
+  /*
+   * Issue prefetches for the header and the mark-bitmap word of an object
+   * that is about to be marked, so that mark_black() doesn't stall on them.
+   */
+  static void prefetch_for_marking(const offset_ptr<const gc_allocated> &p, gc_control_block &cb) {
+    if (!p.is_null() && p.is_valid()) {
+      __builtin_prefetch(p.as_bare_pointer());
+      cb.bitmap.prefetch(p);
+    }
+  }
+
   /*
    * Function called by GC thread in the marking phase to empty the work queue.
    * We do *push* based work-load balancing, wherein, overloaded thread *offers*
    * work to idle ones.
+   *
+   * References go through the prefetch ring on their way from the queue
+   * to mark_black(), MPGC_GC_MARK_PREFETCH_DEPTH (default 8, 0 disables
+   * it) objects ahead of being marked. A reference is written to the ring
+   * before it is popped from the queue, and to marking_ref before it is
+   * removed from the ring, so that it is never lost if we die in between.
    */
-  static bool empty_collector_stack(gc_control_block &cb, per_process_struct &p, Traversal_queue &q) {
+  static bool empty_collector_stack(gc_control_block &cb, offset_ptr<const gc_allocated> &marking_ref,
+                                    per_process_struct::mark_prefetch_ring &ring, Traversal_queue &q) {
+    static const std::size_t depth = std::min(ruts::env_value<std::size_t>("MPGC_GC_MARK_PREFETCH_DEPTH", 8),
+                                              per_process_struct::mark_prefetch_ring::capacity);
     bool worked = false;
-    while (!q.empty()) {
-      worked = true;
+    while (true) {
+      while (ring.size() < depth && ring.refill_from(q)) {
+        prefetch_for_marking(ring.back(), cb);
+      }
 
-      p.set_marking_ref(q.front());
-      q.pop();
-      mark_black(p.marking_ref(), cb, q);
-      p.clear_marking_ref();
+      assert(!marking_ref);
+      if (!ring.empty()) {
+        marking_ref = ring.front();
+        ring.pop();
+      } else if (!q.pop(marking_ref)) {
+        break;
+      }
+      worked = true;
+      mark_black(marking_ref, cb, q);
+      marking_ref = nullptr;
+      if (parked_markers.load(std::memory_order_relaxed) > 0 && q.size() >= min_offered_work) {
+        offer_work();
+      }
       if (request_gc_termination) {
         break;
       }
     }
+    gc_marked_counts.flush(*gc_handshake::process_struct);
     return worked;
   }
 
+  static void marker_thread(std::size_t idx) {
+    gc_control_block &cb = control_block();
+    per_process_struct &process_struct = *gc_handshake::process_struct;
+    per_process_struct::marker_slot &slot = process_struct.marker(idx);
+    while (!request_gc_termination) {
+      {
+        std::unique_lock<std::mutex> lk(marking_active_mutex);
+        marking_activated.wait(lk, []{return marking_active || request_gc_termination;});
+      }
+      while (marking_active && !request_gc_termination) {
+        busy_markers++;
+        if (process_struct.steal(slot.queue)) {
+          markers_worked = true;
+          empty_collector_stack(cb, slot.marking_ref, slot.ring, slot.queue);
+          busy_markers--;
+        } else {
+          busy_markers--;
+          park_marker();
+        }
+      }
+    }
+    //Notify with the lock held, as the waiter destroys the condition variable at exit.
+    std::lock_guard<std::mutex> lk(marking_active_mutex);
+    running_markers--;
+    marker_stopped.notify_all();
+  }
+
+  /*
+   * Called at exit once the GC thread has terminated, so that no marker
+   * thread is still waiting on marking_activated when it gets destroyed.
+   */
+  static void stop_marker_threads() {
+    std::unique_lock<std::mutex> lk(marking_active_mutex);
+    marking_activated.notify_all();
+    work_offered.notify_all();
+    marker_stopped.wait(lk, []{return running_markers == 0;});
+  }
+
+  void start_marker_threads() {
+    static const std::size_t n = std::min(std::max(ruts::env_value<std::size_t>("MPGC_GC_MARKER_THREADS", 1),
+                                                   std::size_t(1)),
+                                          per_process_struct::max_marker_threads);
+    gc_handshake::process_struct->set_nr_marker_slots(n - 1);
+    //Counted here, so that stop_marker_threads() waits even for those not yet running.
+    {
+      std::lock_guard<std::mutex> lk(marking_active_mutex);
+      running_markers += n - 1;
+    }
+    for (std::size_t i = 0; i < n - 1; i++) {
+      std::thread(marker_thread, i).detach();
+    }
+  }
+
+  /*
+   * Empties the GC thread's queue and then helps the process's other
+   * marker threads until none of them has anything left. Returns true if
+   * any marking was done by any of them.
+   */
+  static bool empty_process_stacks(gc_control_block &cb, per_process_struct &p, Traversal_queue &q) {
+    bool worked = empty_collector_stack(cb, p.marking_ref(), p.prefetch_ring(), q);
+    if (p.nr_marker_slots() == 0) {
+      return worked;
+    }
+    while (busy_markers > 0 && !request_gc_termination) {
+      if (p.steal_from_markers(q)) {
+        worked = true;
+        empty_collector_stack(cb, p.marking_ref(), p.prefetch_ring(), q);
+      } else {
+        std::cpu_relax();
+      }
+    }
+    return markers_worked.exchange(false) || worked;
+  }
+
   static void consume_dead_process_refs(per_process_struct &process_struct, Traversal_queue &my_q) {
     gc_control_block &cb = control_block();
     Traversal_queue &q = process_struct.traversal_queue();
@@ -349,20 +823,39 @@ namespace mpgc {
           my_q.push(p);
         });
       }
+      //Marks staged but not yet published. Pushing them twice does no harm.
+      const std::size_t n = m->n_mark_staged;
+      for (std::size_t i = 0; i < n; i++) {
+        my_q.push(m->mark_staging[i]);
+      }
+      m->n_mark_staged = 0;
       m = mb_list.next(m);
     }
-    my_q.push(process_struct.marking_ref());
-    if (cb.bitmap.is_marked(process_struct.marking_ref())) {//if we decide to us control bitmap, we can condition on that too
-      cb.ctrl_map.process_and_remove(process_struct.marking_ref(),
-                                     [&my_q, &cb](const offset_ptr<const gc_allocated> &p) {
-                                       if (!cb.bitmap.is_marked(p)) {
-                                         my_q.push(p);
-                                       }
-                                     });
-      //Control bit must be cleared after processing ctrl map entry.
-    //  cb.bitmap.clear_control_mark(p);
+    auto consume_marking_ref = [&my_q, &cb](const offset_ptr<const gc_allocated> &ref) {
+      my_q.push(ref);
+      if (!array_chunk_ref::is_chunk(ref) && cb.bitmap.is_marked(ref)) {//if we decide to us control bitmap, we can condition on that too
+        cb.ctrl_map.process_and_remove(ref,
+                                       [&my_q, &cb](const offset_ptr<const gc_allocated> &p) {
+                                         if (!cb.bitmap.is_marked(p)) {
+                                           my_q.push(p);
+                                         }
+                                       });
+        //Control bit must be cleared after processing ctrl map entry.
+      //  cb.bitmap.clear_control_mark(p);
+      }
+    };
+    auto push_ref = [&my_q](const offset_ptr<const gc_allocated> &p) {
+      my_q.push(p);
+    };
+    consume_marking_ref(process_struct.marking_ref());
+    process_struct.prefetch_ring().for_each(push_ref);
+    my_q.takeover(q);
+    for (std::size_t i = 0; i < process_struct.nr_marker_slots(); i++) {
+      per_process_struct::marker_slot &slot = process_struct.marker(i);
+      consume_marking_ref(slot.marking_ref);
+      slot.ring.for_each(push_ref);
+      my_q.takeover(slot.queue);
     }
-    my_q.takeover_locals(q);
   }
 
   template <typename Func, typename ...Args>
@@ -592,7 +1085,7 @@ namespace mpgc {
 
       while (p->steal(q)) {
         helped = true;
-        empty_collector_stack(cb, process_struct, q);
+        empty_process_stacks(cb, process_struct, q);
         if (request_gc_termination) {
           return helped;
         }
@@ -617,6 +1110,13 @@ namespace mpgc {
 
     constexpr auto version_bits_fld = bits::field<uint16_t, uint16_t>(2, 14);
     constexpr auto stage_bits_fld = bits::field<Weak_stage, uint16_t>(0, 2);
+
+    //Let the other marker threads of this process help for as long as we are here.
+    struct marker_activation {
+      marker_activation() { set_marking_active(true); }
+      ~marker_activation() { set_marking_active(false); }
+    } activation;
+
     while (true) {
       while (!clean) {
         if (iter++ > 0) {
@@ -659,7 +1159,7 @@ namespace mpgc {
 	      t = thread_list.next(t);
 	    }
             do_handshake = false;
-	    empty_collector_stack(cb, process_struct, q);
+	    empty_process_stacks(cb, process_struct, q);
 	  }
 	  // Let's help others.
 	  if (!help_other_processes(cb, process_struct, q)) {
@@ -722,10 +1222,10 @@ namespace mpgc {
 		nr_live_process = temp_live_process;
 	      }
 	      /* Set clean to false if work done. Otherwise, leave it as is.
-	       * It's important to have empty_collector_stack as the first
+	       * It's important to have empty_process_stacks as the first
 	       * operand to && so that the function is called no matter what.
 	       */
-	      clean = !empty_collector_stack(cb, process_struct, q) && clean;
+	      clean = !empty_process_stacks(cb, process_struct, q) && clean;
 	    } else {
 	      /* This needs some explanation! Consider a scenario where GC thread 1
 	       * after incrementing marking barrier 1 steals work from GC thread 2.
@@ -760,6 +1260,18 @@ namespace mpgc {
 
 	assert(q.empty());
 	process_struct.reset_barrier_info(Barrier_indices::marking2);
+	if (clean) {
+	  /* Marks still staged by the barriers (see mark_gray()) count as well.
+	   * They are checked before the mark buffers they are published to.
+	   */
+          for (gc_handshake::in_memory_thread_struct *t = thread_list.head(); t; t = thread_list.next(t)) {
+            if (t->persist_data->n_mark_staged > 0) {
+              clean = false;
+              gc_handshake::request_mark_flush(*t);
+            }
+          }
+          std::atomic_thread_fence(std::memory_order_acquire);
+	}
 	if (local_barrier._info.version != curr_version) {
 	  /* This indicates that somebody has already incremented the version.
 	   * We don't need to do anything now. Just continue.
@@ -960,6 +1472,31 @@ namespace mpgc {
     assert(begin == end);
   }
 
+  /*
+   * With MPGC_GC_RELEASE_FREE_KB set (to, say, 256), a free run found by the
+   * sweep that is at least that many kilobytes long has its whole pages past
+   * the chunk header punched out of the heap file before it goes on the free
+   * list, so that a dead large object doesn't keep its memory resident. The
+   * pages read back as zero in every process. Nothing parses the inside of a
+   * free chunk, so only the header has to survive. It is off by default, as
+   * the next allocation there has to fault every page back in.
+   */
+  static void release_free_run(std::size_t *begin, const std::size_t size) {
+    static const std::size_t min_words = ruts::env_value<std::size_t>("MPGC_GC_RELEASE_FREE_KB", 0) << 7;
+    static std::atomic<bool> punch_supported(true);
+    if (min_words == 0 || size < min_words || !punch_supported.load(std::memory_order_relaxed)) {
+      return;
+    }
+    static const std::size_t page = sysconf(_SC_PAGESIZE);
+    const std::size_t page_begin =
+      gc_allocator::align_size_up(reinterpret_cast<std::size_t>(begin) + sizeof(gc_allocator::global_chunk), page);
+    const std::size_t page_end = reinterpret_cast<std::size_t>(begin + size) & ~(page - 1);
+    if (page_end > page_begin
+        && madvise(reinterpret_cast<void*>(page_begin), page_end - page_begin, MADV_REMOVE) != 0) {
+      punch_supported.store(false, std::memory_order_relaxed);
+    }
+  }
+
   static void put_to_global(gc_control_block &cb,
                             gc_allocator::skiplist& list,
                             chunk_expansion_slot &slot,
@@ -982,10 +1519,12 @@ namespace mpgc {
     if (size < (sizeof(gc_allocator::global_chunk) >> 3)) {
       return;
     }
+    cb.mem_stats.swept_free_chunk(size << 3);
     std::size_t *begin = reinterpret_cast<std::size_t*>(base_offset_ptr::base()) + beg_word;
     erase_gc_descriptors_from_free_chunk(begin, size);
   
     offset_ptr<gc_allocator::global_chunk> c = new (begin) gc_allocator::global_chunk(size);
+    release_free_run(begin, size);
 
     std::atomic_signal_fence(std::memory_order_release);
     slot.ptr = nullptr;
@@ -1214,37 +1753,49 @@ namespace mpgc {
     assert(ptr->is_null() || (ptr->is_weak() && ptr->is_valid() && is_marked(ptr)));
   }
 
-  void mark_bitmap::cleanup_weak_ptrs(gc_control_block &cb,
-                                      std::size_t begin,
-                                      const std::size_t end) {
-    const bit_number_t begin_bit = compute_bit_number(begin);
-    bitmap_idx_t begin_idx = compute_bitmap_index(begin);
-    const bit_number_t end_bit = compute_bit_number(end);
-    const bitmap_idx_t end_idx = compute_bitmap_index(end);
-    assert(begin_idx < end_idx || (begin_idx == end_idx && begin_bit <= end_bit));
-    std::size_t * const base = reinterpret_cast<std::size_t*>(base_offset_ptr::base());
-
-    auto func = [this, base, end, &cb](rep_t val, std::size_t begin) {
-      while (val) {
-        std::size_t clz = __builtin_clzl(val);
-        assert(clz < bits_per_value);
-        //NOTE:Shifting 64-bit is undefined. So we don't B <<= clz + 1.
-        val <<= clz;
-        begin += clz;
-        atomic_cleanup_weak_ptr(cb, base + begin);
-        assert(begin <= end);
-        begin++;
-        val <<= 1;
+  /*
+   * Clears the weak pointers at words[i] for each bit i set in B whose
+   * target is neither marked nor sweep-assigned. All the slots and the
+   * begin-bitmap words of their targets are loaded before any is tested,
+   * so that the loads overlap, and only the slots that need clearing pay
+   * for atomic_cleanup_weak_ptr()'s CAS. The CAS can't be a plain store, as
+   * a mutator may store to the same slot at any time during the sweep.
+   */
+  void mark_bitmap::cleanup_weak_word(gc_control_block &cb, std::size_t *words, rep_t B) {
+    std::size_t *slots[bits_per_value];
+    rep_t marked[bits_per_value];
+    std::size_t n = 0;
+    while (B) {
+      const std::size_t clz = __builtin_clzl(B);
+      slots[n++] = words + clz;
+      B &= ~construct_bitmap_word(clz);
+    }
+    for (std::size_t i = 0; i < n; i++) {
+      const offset_ptr<const gc_allocated> p(
+        reinterpret_cast<std::atomic<std::size_t>*>(slots[i])->load(std::memory_order_relaxed));
+      if (p.is_null() || p.is_sweep_assigned()) {
+        marked[i] = 1;
+      } else {
+        const std::size_t beg_word = p.offset() >> 3;
+        marked[i] = lookup_begin(compute_bitmap_index(beg_word)) & construct_bitmap_word(compute_bit_number(beg_word));
       }
-    };
+    }
+    for (std::size_t i = 0; i < n; i++) {
+      if (!marked[i]) {
+        atomic_cleanup_weak_ptr(cb, slots[i]);
+      }
+    }
+  }
 
-    rep_t B = _weak[begin_idx] & construct_left_mask(begin_bit);
-    while (begin_idx < end_idx) {
-      func(B, begin_idx << value_log_bits);
-      B = _weak[++begin_idx];
+  //Cleans up the weak pointers that the weak bitmap records in logical chunk nr_chunk.
+  void mark_bitmap::cleanup_weak_ptrs(gc_control_block &cb, const std::size_t nr_chunk) {
+    std::size_t * const base = reinterpret_cast<std::size_t*>(base_offset_ptr::base());
+    const bitmap_idx_t end_idx = (nr_chunk + 1) << _chunk_log;
+    bitmap_idx_t idx = skip_zero_words(_weak, nr_chunk << _chunk_log, end_idx, 0);
+    while (idx < end_idx) {
+      cleanup_weak_word(cb, base + (idx << value_log_bits), _weak[idx]);
+      idx = skip_zero_words(_weak, idx + 1, end_idx, 0);
     }
-    //Now the last bitmap word.
-    func(B & construct_right_mask(end_bit), begin_idx << value_log_bits);
   }
 
   void mark_bitmap::verify_weak_ptrs_cleanup() {
@@ -1273,10 +1824,12 @@ namespace mpgc {
 
   void mark_bitmap::process_logical_chunk(gc_control_block &cb,
                                           gc_allocator::skiplist &list,
+                                          chunk_expansion_slot &slot,
+                                          std::mt19937 &rand,
                                           const std::size_t nr_chunk,
                                           const bool set_bit) {
     std::size_t first = 0;
-    const std::size_t end = (nr_chunk + 1) << (chunk_size_log_bits + value_log_bits);
+    const std::size_t end = (nr_chunk + 1) << (_chunk_log + value_log_bits);
     std::size_t second;
 
     if (nr_chunk == 0) {
@@ -1284,24 +1837,29 @@ namespace mpgc {
       if (second == end) {
         set_sweep_bitmap_both(0, set_bit);
         second = process_next_chunk_begin(1, set_bit);
-        put_to_global(cb, list, gc_handshake::process_struct->get_sweep1_data(),
-                      first, second - first, gc_handshake::process_struct->rand);
+        put_to_global(cb, list, slot, first, second - first, rand);
         return;
       } else {
-        put_to_global(cb, list, gc_handshake::process_struct->get_sweep1_data(),
-                      first, second - first, gc_handshake::process_struct->rand);
+        put_to_global(cb, list, slot, first, second - first, rand);
       }
     } else {
-      second = nr_chunk << (chunk_size_log_bits + value_log_bits);
+      second = nr_chunk << (_chunk_log + value_log_bits);
+      if (!is_end_summary_set(nr_chunk)) {
+        /* No object ends in this chunk, so no free run starts in it, and
+         * whatever free space it has was put by the sweeper of an earlier
+         * chunk (see process_next_chunk_begin()). A chunk inside a large
+         * object ends up here without its end words being read.
+         */
+        set_sweep_bitmap_end(nr_chunk, set_bit);
+        return;
+      }
     }
 
     bool dirty_end_bitmap = false;
     while (second < end) {
       first = find_next_free_word(second, end, dirty_end_bitmap);
-      //Go through weak-bitmap to fix weak ptrs from second to first.
-      cleanup_weak_ptrs(cb, second, first - 1);
       if (first == end) {
-        rep_t B = _end[((nr_chunk + 1) << chunk_size_log_bits) - 1];
+        rep_t B = lookup_end(((nr_chunk + 1) << _chunk_log) - 1);
         if (B & 0x1) {
           //If the last word of this chunk was end of an object, then we have to process the next chunk's _begin
           second = process_next_chunk_begin(nr_chunk + 1, set_bit);
@@ -1314,8 +1872,7 @@ namespace mpgc {
           second = process_next_chunk_begin(nr_chunk + 1, set_bit);
         }
       }
-      put_to_global(cb, list, gc_handshake::process_struct->get_sweep1_data(),
-                    first, second - first, gc_handshake::process_struct->rand);
+      put_to_global(cb, list, slot, first, second - first, rand);
     }
 
     if (!dirty_end_bitmap) {
@@ -1350,8 +1907,8 @@ namespace mpgc {
   }
 
   void mark_bitmap::set_sweep_bitmap_range(const std::size_t beg_word, const std::size_t end_word, const bool set_bit) {
-    const std::size_t begin_chunk = beg_word >> (chunk_size_log_bits + value_log_bits);
-    const std::size_t end_chunk = end_word >> (chunk_size_log_bits + value_log_bits);
+    const std::size_t begin_chunk = beg_word >> (_chunk_log + value_log_bits);
+    const std::size_t end_chunk = end_word >> (_chunk_log + value_log_bits);
     if (end_chunk - begin_chunk < 2) {
       //Nothing to do;
       return;
@@ -1364,57 +1921,125 @@ namespace mpgc {
     std::size_t &i = gc_handshake::process_struct->get_tolerate_sweep_chunk();
     gc_control_block &cb = control_block();
     gc_allocator::skiplist &list = cb.global_free_lists[gc_handshake::process_struct->global_list_index()];
+    const std::size_t batch = _sweep_batch;
 
     do {
       if (request_gc_termination) {
         break;
       }
-      fetch_logical_chunk_to_process(i);
+      fetch_logical_chunks_to_process(i, batch);
       if (i >= _total_logical_chunks) {
         break;
       }
-      if (!is_end_sweep_bitmap_set(i, set_bitmap)) {
-        process_logical_chunk(cb, list, i, set_bitmap);
+      //i is left at the chunk being swept, in case this process dies.
+      for (const std::size_t last = std::min(i + batch, _total_logical_chunks); i < last; i++) {
+        if (!is_end_sweep_bitmap_set(i, set_bitmap)) {
+          process_logical_chunk(cb, list, gc_handshake::process_struct->get_sweep1_data(),
+                                gc_handshake::process_struct->rand, i, set_bitmap);
+        }
       }
     } while (true);
   }
 
-  void mark_bitmap::_post_sweep_clear(atomic_rep_t &word, atomic_rep_t * bitmap_chunk,
-                                      atomic_rep_t * other_bitmap_chunk, const bool set_bit) {
+  /*
+   * Clears the weak pointers to unmarked objects, a batch of logical chunks
+   * of the weak bitmap at a time, as sweep2_phase() does for the mark
+   * bitmap. It runs once the process is done with sweep2, while the other
+   * processes may still be sweeping. That is safe because weak bits are only
+   * set in marked objects, which the sweep leaves alone, and the weak stage
+   * stays Clean, so mutators don't load a pointer to a freed object in the
+   * meantime, until post_sweep_weak_ptr_sync().
+   */
+  void mark_bitmap::weak_cleanup_phase(gc_control_block &cb) {
+    std::size_t &c = gc_handshake::process_struct->get_tolerate_weak_chunk();
+    std::size_t &last = gc_handshake::process_struct->get_tolerate_weak_chunk_end();
+    const std::size_t batch = _sweep_batch;
+    while (!request_gc_termination) {
+      const std::size_t i = _weak_chunks.fetch_add(batch);
+      if (i >= _total_logical_chunks) {
+        break;
+      }
+      /* c is recorded before last, so that a process dying in between
+       * leaves an empty range rather than one reaching into another batch.
+       */
+      c = i;
+      std::atomic_signal_fence(std::memory_order_release);
+      last = std::min(i + batch, _total_logical_chunks);
+      //c is left at the chunk being cleaned, in case this process dies.
+      for (; c < last; c++) {
+        cleanup_weak_ptrs(cb, c);
+      }
+    }
+  }
+
+  //Cleans up what is left of the batch a dead process claimed in weak_cleanup_phase().
+  void mark_bitmap::finish_weak_cleanup(gc_control_block &cb, per_process_struct *p) {
+    std::size_t &c = p->get_tolerate_weak_chunk();
+    for (const std::size_t last = p->get_tolerate_weak_chunk_end(); c < last; c++) {
+      cleanup_weak_ptrs(cb, c);
+    }
+  }
+
+  /*
+   * Claims the next logical chunk of the sweep2 phase, if any is left, and
+   * sweeps it into list. Used by allocating threads, which pass their own
+   * expansion slot and random generator. Returns false if every chunk has
+   * already been claimed.
+   */
+  bool mark_bitmap::sweep_unclaimed_chunk(gc_control_block &cb,
+                                          gc_allocator::skiplist &list,
+                                          chunk_expansion_slot &slot,
+                                          std::mt19937 &rand,
+                                          const bool set_bitmap) {
+    std::size_t i;
+    fetch_logical_chunks_to_process(i, 1);
+    if (i >= _total_logical_chunks) {
+      return false;
+    }
+    if (!is_end_sweep_bitmap_set(i, set_bitmap)) {
+      process_logical_chunk(cb, list, slot, rand, i, set_bitmap);
+    }
+    return true;
+  }
+
+  /*
+   * Clears the chunks, starting from nr_chunk, whose bits in the sweep bitmap
+   * word are not yet toggled: their begin and weak words if is_begin, or
+   * else their end words.
+   */
+  void mark_bitmap::_post_sweep_clear(atomic_rep_t &word, std::size_t nr_chunk,
+                                      const bool is_begin, const bool set_bit) {
     rep_t val = word;
-    bool is_other = other_bitmap_chunk != nullptr;
     rep_t iter = construct_bitmap_word(0);
-    const std::size_t size = sizeof(atomic_rep_t) << chunk_size_log_bits;
     if (!set_bit) {
       val = ~val;
     }
     while (iter) {
       if (!(val & iter)) {
-        std::memset(bitmap_chunk, 0x0, size);
-        if (is_other) {
-          std::memset(other_bitmap_chunk, 0x0, size);
+        if (is_begin) {
+          clear_chunk_begin(nr_chunk);
+          clear_chunk_weak(nr_chunk);
+        } else {
+          clear_chunk_end(nr_chunk);
         }
         set_sweep_bitmap(word, iter, set_bit);
       }
       iter >>= 1;
-      bitmap_chunk += 1 << chunk_size_log_bits;
-      if (is_other) {
-        other_bitmap_chunk += 1 << chunk_size_log_bits;
-      }
+      nr_chunk++;
     }
   }
 
   void mark_bitmap::post_sweep_clear(const std::size_t nr_sweep_bitmap_word, const bool set_bit) {
-    if (nr_sweep_bitmap_word >= _total_logical_chunks) {
+    if (nr_sweep_bitmap_word >= _sweep_bitmap_size) {
       /* This is possible if a process terminates after finishing
        * sweep_phase2 but before fetching first bitmap word.
        */
       return;
     }
     assert(nr_sweep_bitmap_word < _sweep_bitmap_size);
-    const std::size_t word_begin = nr_sweep_bitmap_word << (value_log_bits + chunk_size_log_bits);
-    _post_sweep_clear(_sweep_bitmap_begin[nr_sweep_bitmap_word], _begin + word_begin, _weak + word_begin, set_bit);
-    _post_sweep_clear(_sweep_bitmap_end[nr_sweep_bitmap_word], _end + word_begin, nullptr, set_bit);
+    const std::size_t first_chunk = nr_sweep_bitmap_word << value_log_bits;
+    _post_sweep_clear(_sweep_bitmap_begin[nr_sweep_bitmap_word], first_chunk, true, set_bit);
+    _post_sweep_clear(_sweep_bitmap_end[nr_sweep_bitmap_word], first_chunk, false, set_bit);
   }
 
   void mark_bitmap::post_sweep_phase(per_process_struct *process_struct, const bool set_bit) {
@@ -1433,6 +2058,17 @@ namespace mpgc {
     } while (true);
   }
 
+  /*
+   * Closes the sweep2 phase to allocating threads and waits for those
+   * still sweeping a chunk (see mutator_sweep()).
+   */
+  static void disable_mutator_sweeping(per_process_struct *p) {
+    p->sweep2_enabled = false;
+    while (p->lazy_sweepers != 0) {
+      std::cpu_relax();
+    }
+  }
+
   static void ensure_no_mutator_sweeping(per_process_struct *p) {
     Mutator_persist_list &mb_list = p->mutator_persist_list();
 
@@ -1502,6 +2138,24 @@ namespace mpgc {
     return false;
   }
 
+  /*
+   * Cleanup function called at the sweep2 barrier for a process that
+   * crashed in weak_cleanup_phase(), as cleanup_post_sweep_phase() does
+   * for post_sweep_phase().
+   */
+  static bool cleanup_weak_cleanup_phase(per_process_struct *p, per_process_struct::liveness &expected) {
+    gc_control_block &cb = control_block();
+    per_process_struct::liveness desired = gc_handshake::process_struct->get_liveness();
+    if (p->set_liveness(expected, desired)) {
+      cb.bitmap.finish_weak_cleanup(cb, p);
+      expected.is_live = per_process_struct::Alive::Dead;
+      bool assert_test = p->set_liveness(desired, expected);
+      assert(assert_test);
+      return true;
+    }
+    return false;
+  }
+
   /*
    * Cleanup function called for a crashed process for recovery. After cleanup,
    * it restores the ownserhip of the dead process' structure that is taken
@@ -1539,7 +2193,6 @@ namespace mpgc {
       case Barrier_indices::sync:
       case Barrier_indices::preMarking:
       case Barrier_indices::preSweep:
-      case Barrier_indices::sweep2:
       case Barrier_indices::postSweep1:
         temp_live_process = cleanup_failures(action_on_dead_process,
                                              [](per_process_struct *p, per_process_struct::liveness &expected) -> bool {
@@ -1550,6 +2203,9 @@ namespace mpgc {
       case Barrier_indices::sweep1:
         temp_live_process = cleanup_failures(action_on_dead_process, cleanup_sweep1_phase, set_bit);
         break;
+      case Barrier_indices::sweep2:
+        temp_live_process = cleanup_failures(action_on_dead_process, cleanup_weak_cleanup_phase);
+        break;
       case Barrier_indices::postSweep2:
         temp_live_process = cleanup_failures(action_on_dead_process, cleanup_post_sweep_phase, set_bit);
         break;
@@ -1597,15 +2253,72 @@ namespace mpgc {
                 << ms.bytes_in_heap()
                 << ", " << ms.n_processes() << " process"
                 << (ms.n_processes()==1 ? "" : "es")
+                << "; last sweep: " << ms.free_chunks_after_sweep() << " free chunks"
+                << ", largest " << ms.largest_free_chunk_bytes() << " bytes"
+                << ", " << ms.skiplist_nodes_after_sweep() << " skiplist nodes"
                 << "]" << std::endl;
     }
   }
   
+  /*
+   * Holds the GC thread between cycles until the shared memory stats say
+   * that a cycle should start (see gc_mem_stats::should_start_cycle()) or
+   * until some other process has already started one.  Since every process
+   * decides based on the same shared state and the move of cb.status out of
+   * sigSweep remains the only way to start a cycle, a process can't start a
+   * cycle that the others ignore.  MPGC_GC_OCCUPANCY_TARGET gives the target
+   * as a percentage of the heap.  Setting it to 0 gives back-to-back cycles.
+   */
+  static double gc_occupancy_target() {
+    static const double target = ruts::env_value("MPGC_GC_OCCUPANCY_TARGET", 50.0) / 100;
+    return target;
+  }
+
+  void wait_for_gc_trigger(const gc_control_block &cb) {
+    const double target = gc_occupancy_target();
+    if (target <= 0) {
+      return;
+    }
+    while (!request_gc_termination &&
+           cb.status.load().status() == gc_handshake::Signum::sigSweep &&
+           !cb.mem_stats.should_start_cycle(target)) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+
+  /*
+   * With MPGC_GC_LAZY_SWEEP set, the GC thread doesn't sweep the logical
+   * chunks of the sweep2 phase as soon as sweep1 is done.  It leaves them
+   * to allocating threads, which sweep them one at a time as the global
+   * free list runs dry (see mutator_sweep()), and only sweeps whatever is
+   * left once the next cycle is due, once another process has finished
+   * its share, or once every chunk has been claimed.  The post-sweep
+   * barriers and bitmap clearing then run as usual, just before the next
+   * mark rather than right after this one.
+   */
+  static bool lazy_sweep_enabled() {
+    static const bool lazy = ruts::env_flag("MPGC_GC_LAZY_SWEEP");
+    return lazy && gc_occupancy_target() > 0;
+  }
+
+  static void wait_for_lazy_sweep(const gc_control_block &cb) {
+    const double target = gc_occupancy_target();
+    while (!request_gc_termination &&
+           cb.bitmap.has_unclaimed_logical_chunks() &&
+           cb.barrier_sync[Barrier_indices::sweep2] == 0 &&
+           !cb.mem_stats.should_start_cycle(target)) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+
   void start_gc(Stage local_stage) {
     gc_control_block &cb = control_block();
     int count = 0;
     std::size_t gc_cycle_num = cb.mem_stats.cycle_number();
+    bool cycle_counted = false;
     gc_status local_status = gc_handshake::process_struct->get_gc_status();
+    //When this process passed the barriers around each sweep phase, or 0.
+    std::int64_t sweep_barrier_ns[gc_mem_stats::n_sweep_phases + 1] = {};
 
     //Following switch-case is to fix the barrier info to contain right barrier index.
     switch (local_stage) {
@@ -1628,11 +2341,16 @@ namespace mpgc {
       trace_gc_cycle(count, cb);
       switch (local_stage) {
       case Stage::Sweeped: {
+        wait_for_gc_trigger(cb);
+        if (request_gc_termination) {
+          break;
+        }
         local_status.status_idx.status = gc_handshake::Signum::sigSweep;
         if (cb.status.compare_exchange_strong(local_status,
                                               gc_status(gc_handshake::Signum::sigSync1,
                                               local_status.status_idx.idx))) {
           local_status.status_idx.status = gc_handshake::Signum::sigSync1;
+          cb.mem_stats.cycle_started();
         }
         gc_handshake::process_struct->set_gc_status(local_status.data);
         assert(gc_handshake::process_struct->get_gc_status() == cb.status.load().data);
@@ -1683,7 +2401,7 @@ namespace mpgc {
         cb.barrier_sync[Barrier_indices::sweep2] = 0;
         cb.barrier_sync[Barrier_indices::postSweep1] = 0;
         cb.barrier_sync[Barrier_indices::postSweep2] = 0;
-        cb.bitmap.reset_logical_chunk_count();
+        cb.bitmap.reset_logical_chunk_count(cb.total_process_count.load().count);
 
         local_status.status_idx.status = gc_handshake::Signum::sigSync2;
         if (cb.status.compare_exchange_strong(local_status,
@@ -1705,9 +2423,12 @@ namespace mpgc {
           if (request_gc_termination) {
             break;
           }
+          gc_handshake::scan_stack_snapshots(gc_handshake::process_struct->traversal_queue());
           clear_sweep_assigned_inbound_weak_ptrs(cb);
           //Main marking phase
           marking_phase(*gc_handshake::process_struct);
+          //Marking is over, so mark_gray() may stage again.
+          gc_handshake::publish_marks_eagerly = false;
           if (request_gc_termination) {
             break;
           }
@@ -1744,6 +2465,7 @@ namespace mpgc {
         if (request_gc_termination) {
           break;
         }
+        sweep_barrier_ns[0] = gc_mem_stats::now_ns();
         cb.barrier_sync[Barrier_indices::preMarking] = 0;
         gc_handshake::process_struct->sweep1_enabled = true;
 
@@ -1759,13 +2481,32 @@ namespace mpgc {
         local_stage = Stage::Sweeping;
       }
       case Stage::Sweeping: {
+        if (lazy_sweep_enabled()) {
+          /* The cycle is counted right after this barrier, so the counts of
+           * the objects every process allocated black while marking must be
+           * in the per_process_structs by then (see fold_process_counts()).
+           */
+          gc_handshake::process_struct->fold_mutator_counts();
+        }
         synchronize_gc_threads(Barrier_indices::sweep1, local_stage);
         if (request_gc_termination) {
           break;
         }
+        sweep_barrier_ns[1] = gc_mem_stats::now_ns();
         cb.ctrl_map.clear();
 
+        gc_handshake::process_struct->sweep2_enabled = true;
+        if (lazy_sweep_enabled()) {
+          /* Marking is over in every process, so the cycle can be counted
+           * now, which gives the trigger below fresh occupancy stats.
+           */
+          gc_cycle_num = cb.mem_stats.inc_cycle_num_to(gc_cycle_num+1);
+          cycle_counted = true;
+          wait_for_lazy_sweep(cb);
+        }
         cb.bitmap.sweep2_phase(local_status.status_idx.idx);
+        disable_mutator_sweeping(gc_handshake::process_struct);
+        cb.bitmap.weak_cleanup_phase(cb);
         if (request_gc_termination) {
           break;
         }
@@ -1774,6 +2515,7 @@ namespace mpgc {
         if (request_gc_termination) {
           break;
         }
+        sweep_barrier_ns[2] = gc_mem_stats::now_ns();
 
         post_sweep_weak_ptr_sync(cb, gc_handshake::process_struct);
         if (request_gc_termination) {
@@ -1790,19 +2532,31 @@ namespace mpgc {
           break;
         }
 
+        //So that whichever process increments the cycle number has them.
+        gc_handshake::process_struct->fold_mutator_counts();
         synchronize_gc_threads(Barrier_indices::postSweep2, local_stage, local_status.status_idx.idx);
         if (request_gc_termination) {
           break;
         }
+        sweep_barrier_ns[3] = gc_mem_stats::now_ns();
         gc_handshake::process_struct->reset_tolerate_sweep_chunk();
         //cb.bitmap.test_bitmaps(local_status.status_idx.idx);
 
-        cb.stage.compare_exchange_strong(local_stage, Stage::Sweeped);
+        if (cb.stage.compare_exchange_strong(local_stage, Stage::Sweeped)) {
+          std::int64_t phase_ns[gc_mem_stats::n_sweep_phases];
+          for (std::size_t i = 0; i < gc_mem_stats::n_sweep_phases; i++) {
+            phase_ns[i] = sweep_barrier_ns[i + 1] - sweep_barrier_ns[i];
+          }
+          cb.mem_stats.sweep_finished(cb.global_free_lists[gc_handshake::process_struct->global_list_index()].node_count(),
+                                      sweep_barrier_ns[0] != 0 ? phase_ns : nullptr);
+        }
+        std::fill(std::begin(sweep_barrier_ns), std::end(sweep_barrier_ns), 0);
         local_stage = Stage::Sweeped;
 
         cb.global_free_lists[gc_handshake::process_struct->global_list_index()].help_unfinished_bump_alloc();
         cb.global_free_lists[1 - gc_handshake::process_struct->global_list_index()].reset();
         gc_handshake::thread_struct_list.deletion(gc_handshake::in_memory_thread_struct::is_marked);
+        cb.mem_stats.fold_dead_process_counts(gc_handshake::process_struct);
         cb.process_struct_list.deletion(gc_handshake::process_struct, per_process_struct::is_marked);
         gc_handshake::process_struct->clear();
       }
@@ -1820,7 +2574,10 @@ namespace mpgc {
       // This may not be the appropriate place to put this.  We want
       // it at a point where nobody's marking yet and everybody's
       // finished marking.
-      gc_cycle_num = cb.mem_stats.inc_cycle_num_to(gc_cycle_num+1);
+      if (!cycle_counted) {
+        gc_cycle_num = cb.mem_stats.inc_cycle_num_to(gc_cycle_num+1);
+      }
+      cycle_counted = false;
     } //while(true)
   }
 
@@ -1839,7 +2596,10 @@ namespace mpgc {
    */
   void atexit_gc_handler() {
     request_gc_termination = 1;
-    std::unique_lock<std::mutex> lk(gc_termination_mutex);
-    gc_terminated.wait(lk, []{return request_gc_termination > 1;});
+    {
+      std::unique_lock<std::mutex> lk(gc_termination_mutex);
+      gc_terminated.wait(lk, []{return request_gc_termination > 1;});
+    }
+    stop_marker_threads();
   }
 }
@@ -0,0 +1,177 @@
+/*
+ *
+ *  Multi Process Garbage Collector
+ *  Copyright © 2016 Hewlett Packard Enterprise Development Company LP.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  As an exception, the copyright holders of this Library grant you permission
+ *  to (i) compile an Application with the Library, and (ii) distribute the
+ *  Application containing code generated by the Library and added to the
+ *  Application during this compilation process under terms of your choice,
+ *  provided you also meet the terms and conditions of the Application license.
+ *
+ */
+
+/*
+ * Checks mark_bitmap::skip_zero_words() and skip_zero_words_back() against
+ * a naive loop, with each of the kernels this CPU has, over randomized
+ * bitmaps of both layouts. Every range of the smaller bitmaps is tried, so
+ * that range ends that aren't a multiple of the step, non-zero words right
+ * at a step boundary and empty ranges are all covered. With the interleaved
+ * layout, the words in between belong to the other bitmap and are filled
+ * with garbage that must be ignored.
+ */
+
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+#include "mpgc/gc.h"
+
+using namespace mpgc;
+using namespace std;
+
+namespace {
+  using kernel = mark_bitmap::scan_kernel;
+  using word = atomic<size_t>;
+
+  constexpr size_t no_idx = size_t(-1);
+
+  size_t naive_forward(const vector<size_t> &bm, size_t idx, size_t end_idx, uint8_t sl) {
+    for (; idx < end_idx; idx++) {
+      if (bm[idx << sl] != 0) {
+        return idx;
+      }
+    }
+    return end_idx;
+  }
+
+  size_t naive_back(const vector<size_t> &bm, size_t idx, uint8_t sl) {
+    while (idx > 0) {
+      idx--;
+      if (bm[idx << sl] != 0) {
+        return idx;
+      }
+    }
+    return no_idx;
+  }
+
+  size_t n_failures = 0;
+
+  void report(const char *what, const char *kernel_name, uint8_t sl, size_t n,
+              size_t idx, size_t end_idx, size_t got, size_t expected) {
+    if (n_failures++ < 20) {
+      cout << what << " (" << kernel_name << ", stride_log " << unsigned(sl)
+           << ", " << n << " words) from " << idx << " to " << end_idx
+           << ": got " << got << ", expected " << expected << endl;
+    }
+  }
+
+  /* Checks every [idx, end_idx) range of bm if exhaustive, and a few
+   * hundred random ones otherwise.
+   */
+  void check(const vector<size_t> &bm, size_t n, uint8_t sl, bool exhaustive,
+             const vector<pair<kernel, const char*>> &kernels, mt19937 &rand) {
+    const word *bits = reinterpret_cast<const word*>(bm.data());
+    auto check_range = [&](size_t idx, size_t end_idx) {
+      const size_t fwd = naive_forward(bm, idx, end_idx, sl);
+      for (const auto &k : kernels) {
+        size_t got = mark_bitmap::skip_zero_words(bits, idx, end_idx, sl, k.first);
+        if (got != fwd) {
+          report("skip_zero_words", k.second, sl, n, idx, end_idx, got, fwd);
+        }
+      }
+    };
+    auto check_back = [&](size_t idx) {
+      const size_t back = naive_back(bm, idx, sl);
+      for (const auto &k : kernels) {
+        size_t got = mark_bitmap::skip_zero_words_back(bits, idx, sl, k.first);
+        if (got != back) {
+          report("skip_zero_words_back", k.second, sl, n, idx, idx, got, back);
+        }
+      }
+    };
+    if (exhaustive) {
+      for (size_t idx = 0; idx <= n; idx++) {
+        for (size_t end_idx = idx; end_idx <= n; end_idx++) {
+          check_range(idx, end_idx);
+        }
+        check_back(idx);
+      }
+    } else {
+      for (size_t i = 0; i < 300; i++) {
+        size_t idx = rand() % (n + 1);
+        check_range(idx, idx + rand() % (n - idx + 1));
+        check_back(idx);
+      }
+    }
+  }
+
+  /* A bitmap of n words with each word non-zero with probability density,
+   * spread out by the layout's stride.
+   */
+  vector<size_t> random_bitmap(size_t n, uint8_t sl, double density, mt19937 &rand) {
+    bernoulli_distribution set(density);
+    vector<size_t> bm(max(n << sl, size_t(1)), 0);
+    for (size_t i = 0; i < bm.size(); i++) {
+      if ((i & ((size_t(1) << sl) - 1)) != 0) {
+        bm[i] = rand() | 1;
+      } else if (set(rand)) {
+        bm[i] = size_t(1) << (rand() % 64);
+      }
+    }
+    return bm;
+  }
+}
+
+int main() {
+  vector<pair<kernel, const char*>> kernels = {{kernel::scalar, "scalar"}, {kernel::best, "best"}};
+  if (mark_bitmap::has_scan_kernel(kernel::avx2)) {
+    kernels.emplace_back(kernel::avx2, "avx2");
+  }
+  cout << "Checking kernels:";
+  for (const auto &k : kernels) {
+    cout << " " << k.second;
+  }
+  cout << endl;
+
+  mt19937 rand(42);
+  const double densities[] = {0.0, 0.01, 0.05, 0.2, 0.9};
+  for (uint8_t sl = 0; sl <= 1; sl++) {
+    for (double density : densities) {
+      for (size_t n = 0; n <= 48; n++) {
+        for (size_t rep = 0; rep < 4; rep++) {
+          check(random_bitmap(n, sl, density, rand), n, sl, true, kernels, rand);
+        }
+      }
+      for (size_t rep = 0; rep < 200; rep++) {
+        size_t n = 49 + rand() % 4000;
+        check(random_bitmap(n, sl, density, rand), n, sl, false, kernels, rand);
+      }
+    }
+    //A single non-zero word at every position, on either side of every boundary.
+    for (size_t n = 1; n <= 40; n++) {
+      for (size_t pos = 0; pos < n; pos++) {
+        vector<size_t> bm = random_bitmap(n, sl, 0.0, rand);
+        bm[pos << sl] = size_t(1) << (rand() % 64);
+        check(bm, n, sl, true, kernels, rand);
+      }
+    }
+  }
+
+  cout << (n_failures == 0 ? "PASSED" : "FAILED") << endl;
+  return n_failures == 0 ? 0 : 1;
+}
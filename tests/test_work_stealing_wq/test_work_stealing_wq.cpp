@@ -0,0 +1,196 @@
+/*
+ *
+ *  Multi Process Garbage Collector
+ *  Copyright © 2016 Hewlett Packard Enterprise Development Company LP.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  As an exception, the copyright holders of this Library grant you permission
+ *  to (i) compile an Application with the Library, and (ii) distribute the
+ *  Application containing code generated by the Library and added to the
+ *  Application during this compilation process under terms of your choice,
+ *  provided you also meet the terms and conditions of the Application license.
+ *
+ */
+
+/*
+ * Races an owner pushing and popping on a work_stealing_wq against
+ * several thieves, which steal into deques of their own (and from each
+ * other), and checks that every element comes out exactly once. The
+ * owner pushes in bursts larger than the initial capacity, so the
+ * arrays grow while thieves are stealing. A second round has the owner
+ * "die" half way and a rescuer take its deque over while the thieves
+ * keep stealing from it.
+ *
+ * The arrays live in the managed space, which initialize() attaches to
+ * along with the heap, so run createheap first.
+ */
+
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+#include "mpgc/gc.h"
+#include "mpgc/work_stealing_wq.h"
+
+using namespace mpgc;
+using namespace std;
+
+namespace {
+  using wq_type = work_stealing_wq<size_t>;
+
+  constexpr size_t n_thieves = 4;
+  constexpr size_t n_elements = 1000000;
+  constexpr size_t max_burst = 5000;
+
+  struct round_state {
+    wq_type owner_q;
+    vector<unique_ptr<wq_type>> thief_qs;
+    unique_ptr<atomic<uint8_t>[]> seen;
+    atomic<bool> owner_done;
+
+    round_state() : seen(new atomic<uint8_t>[n_elements + 1]), owner_done(false) {
+      for (size_t i = 0; i <= n_elements; i++) {
+        seen[i] = 0;
+      }
+      for (size_t i = 0; i < n_thieves; i++) {
+        thief_qs.emplace_back(new wq_type());
+      }
+    }
+
+    void got(size_t v) {
+      if (v == 0 || v > n_elements) {
+        cout << "Got bogus element " << v << endl;
+        abort();
+      }
+      seen[v]++;
+    }
+
+    void drain(wq_type &q) {
+      size_t v;
+      while (q.pop(v)) {
+        got(v);
+      }
+    }
+
+    /* Steals from the owner (or whoever else is given) and the other
+     * thieves until the owner is done and nothing is left to steal.
+     */
+    void thief(size_t me, wq_type *also) {
+      mt19937 rand(me);
+      wq_type &mine = *thief_qs[me];
+      while (true) {
+        bool stole = owner_q.steal(mine) || (also && also->steal(mine));
+        if (!stole) {
+          size_t victim = rand() % n_thieves;
+          stole = victim != me && thief_qs[victim]->steal(mine);
+        }
+        drain(mine);
+        if (!stole && owner_done && owner_q.empty() && (!also || also->empty())) {
+          bool all_empty = true;
+          for (auto &q : thief_qs) {
+            all_empty = all_empty && q->empty();
+          }
+          if (all_empty) {
+            return;
+          }
+        }
+      }
+    }
+
+    /* Pushes elements first..last in bursts, popping some after each. */
+    void push_range(size_t first, size_t last, mt19937 &rand) {
+      size_t next = first;
+      while (next <= last) {
+        size_t burst = 1 + rand() % max_burst;
+        for (size_t i = 0; i < burst && next <= last; i++) {
+          owner_q.push(next++);
+        }
+        size_t n_pops = rand() % (burst + 1);
+        size_t v;
+        for (size_t i = 0; i < n_pops && owner_q.pop(v); i++) {
+          got(v);
+        }
+      }
+    }
+
+    bool check(const char *what) {
+      size_t lost = 0, dups = 0;
+      for (size_t i = 1; i <= n_elements; i++) {
+        if (seen[i] == 0) {
+          lost++;
+        } else if (seen[i] > 1) {
+          dups++;
+        }
+      }
+      cout << what << ": " << lost << " lost, " << dups << " duplicated" << endl;
+      return lost == 0 && dups == 0;
+    }
+  };
+
+  bool test_races(unsigned seed) {
+    round_state s;
+    vector<thread> thieves;
+    for (size_t i = 0; i < n_thieves; i++) {
+      thieves.emplace_back([&s, i] { s.thief(i, nullptr); });
+    }
+    mt19937 rand(seed);
+    s.push_range(1, n_elements, rand);
+    s.drain(s.owner_q);
+    s.owner_done = true;
+    for (auto &t : thieves) {
+      t.join();
+    }
+    return s.check("push/pop/steal");
+  }
+
+  bool test_takeover(unsigned seed) {
+    round_state s;
+    wq_type rescuer_q;
+    vector<thread> thieves;
+    for (size_t i = 0; i < n_thieves; i++) {
+      thieves.emplace_back([&s, &rescuer_q, i] { s.thief(i, &rescuer_q); });
+    }
+    mt19937 rand(seed);
+    //The owner leaves elements behind when it stops.
+    s.push_range(1, n_elements / 2, rand);
+    for (size_t i = n_elements / 2 + 1; i <= n_elements; i++) {
+      s.owner_q.push(i);
+    }
+    thread rescuer([&s, &rescuer_q] {
+      rescuer_q.takeover(s.owner_q);
+      s.drain(rescuer_q);
+    });
+    rescuer.join();
+    s.owner_done = true;
+    for (auto &t : thieves) {
+      t.join();
+    }
+    return s.check("takeover");
+  }
+}
+
+int main() {
+  mpgc::initialize();
+  bool ok = true;
+  for (unsigned seed = 1; seed <= 3; seed++) {
+    ok = test_races(seed) && ok;
+    ok = test_takeover(seed) && ok;
+  }
+  cout << (ok ? "PASSED" : "FAILED") << endl;
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,134 @@
+/*
+ *
+ *  Multi Process Garbage Collector
+ *  Copyright © 2016 Hewlett Packard Enterprise Development Company LP.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  As an exception, the copyright holders of this Library grant you permission
+ *  to (i) compile an Application with the Library, and (ii) distribute the
+ *  Application containing code generated by the Library and added to the
+ *  Application during this compilation process under terms of your choice,
+ *  provided you also meet the terms and conditions of the Application license.
+ *
+ */
+
+/*
+ * Measures the cost of the write barrier's marking: first mark_gray() on
+ * its own, over objects nothing has marked, and then pointer stores into a
+ * table while the GC is kept running cycle after cycle, so that the
+ * barriers mark.  Run createheap first.
+ *
+ * usage: barrier-bench [objects (1M)] [stores (20M)] [repetitions (3)]
+ */
+
+#include "mpgc/gc.h"
+#include "mpgc/write_barrier.h"
+
+#include <iostream>
+#include <chrono>
+#include <thread>
+#include <cstdlib>
+
+using namespace mpgc;
+using namespace std;
+
+namespace {
+  using clock_type = chrono::steady_clock;
+
+  using node = gc_array<long>;
+
+  using table_t = gc_array<gc_ptr<node>>;
+
+  double ms_since(clock_type::time_point start) {
+    return chrono::duration<double, milli>(clock_type::now() - start).count();
+  }
+
+  void wait_for_cycles() {
+    gc_mem_stats &stats = memory_stats();
+    while (stats.cycle_requested()) {
+      this_thread::sleep_for(chrono::milliseconds(1));
+    }
+  }
+
+  /*
+   * Marks every object in the table gray, as the barrier does during the
+   * sync phases. The objects stay unmarked until the next cycle, so every
+   * call stages one.
+   */
+  double mark_gray_ms(const gc_ptr<table_t> &table) {
+    gc_handshake::in_memory_thread_struct &thread_struct = *gc_handshake::thread_struct_handles.handle;
+    auto start = clock_type::now();
+    thread_struct.mark_signal_disabled = true;
+    for (const gc_ptr<node> &p : *table) {
+      mark_gray(p.as_offset_pointer(), thread_struct);
+    }
+    thread_struct.mark_signal_disabled = false;
+    double ms = ms_since(start);
+    // Let a cycle consume what we marked.
+    memory_stats().request_cycle();
+    wait_for_cycles();
+    return ms;
+  }
+
+  double store_ms(const gc_ptr<table_t> &table, size_t stores, size_t &cycles) {
+    gc_mem_stats &stats = memory_stats();
+    const size_t n = table->size();
+    const size_t first_cycle = stats.cycle_number();
+    uint64_t x = 88172645463325252ull;
+    auto start = clock_type::now();
+    for (size_t i = 0; i < stores; i++) {
+      if ((i & 0xffff) == 0 && !stats.cycle_requested()) {
+        stats.request_cycle();
+      }
+      x ^= x << 13;
+      x ^= x >> 7;
+      x ^= x << 17;
+      (*table)[x % n] = (*table)[(x >> 32) % n];
+    }
+    double ms = ms_since(start);
+    cycles = stats.cycle_number() - first_cycle;
+    wait_for_cycles();
+    return ms;
+  }
+}
+
+int main(int argc, char **argv) {
+  size_t n = argc > 1 ? strtoul(argv[1], nullptr, 10) : (1 << 20);
+  size_t stores = argc > 2 ? strtoul(argv[2], nullptr, 10) : 20000000;
+  unsigned reps = argc > 3 ? strtoul(argv[3], nullptr, 10) : 3;
+
+  gc_ptr<table_t> table = make_gc_array<gc_ptr<node>>(n);
+  for (size_t i = 0; i < n; i++) {
+    (*table)[i] = make_gc_array<long>(1);
+  }
+  persistent_roots().store("barrier-bench", table);
+  wait_for_cycles();
+
+  double gray_ms = 0, stores_ms = 0;
+  size_t cycles = 0;
+  for (unsigned r = 0; r < reps; r++) {
+    gray_ms += mark_gray_ms(table);
+    size_t c;
+    stores_ms += store_ms(table, stores, c);
+    cycles += c;
+  }
+  cout << "mark_gray: " << n * reps / (gray_ms * 1000) << " M/s ("
+       << gray_ms / reps << " ms for " << n << " objects)" << endl;
+  cout << "stores: " << stores * reps / (stores_ms * 1000) << " M/s ("
+       << stores_ms / reps << " ms for " << stores << ", "
+       << double(cycles) / reps << " cycles)" << endl;
+  persistent_roots().remove("barrier-bench");
+  return 0;
+}
@@ -0,0 +1,142 @@
+/*
+ *
+ *  Multi Process Garbage Collector
+ *  Copyright © 2016 Hewlett Packard Enterprise Development Company LP.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  As an exception, the copyright holders of this Library grant you permission
+ *  to (i) compile an Application with the Library, and (ii) distribute the 
+ *  Application containing code generated by the Library and added to the 
+ *  Application during this compilation process under terms of your choice, 
+ *  provided you also meet the terms and conditions of the Application license.
+ *
+ */
+
+/*
+ * Compares the separate and interleaved mark-bitmap layouts (see
+ * createheap --interleaved) on the two things the collector does with
+ * them: marking objects in random order, and scanning for free runs the
+ * way the sweep does.  The bitmaps are built in the control heap, so run
+ * createheap first.
+ *
+ * usage: bitmap-bench [heap MB (1024)] [percent live (30)] [repetitions (3)]
+ *                     [percent of 1MB regions with any live objects (100)]
+ */
+
+#include "mpgc/gc.h"
+
+#include <iostream>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <cstdlib>
+
+using namespace mpgc;
+using namespace std;
+
+namespace {
+  using clock_type = chrono::steady_clock;
+
+  struct object {
+    size_t begin;
+    size_t end;
+  };
+
+  double ms_since(clock_type::time_point start) {
+    return chrono::duration<double, milli>(clock_type::now() - start).count();
+  }
+
+  /*
+   * Carves the heap into objects of 2-16 words and keeps each with
+   * probability live/100, as long as it lies in one of the 1MB regions
+   * (chosen with probability populated/100) that have live objects at all.
+   * Returned in random order.
+   */
+  vector<object> make_live_objects(size_t heap_words, unsigned live, unsigned populated,
+                                   mt19937_64 &rng) {
+    constexpr size_t region_words = (1 << 20) >> 3;
+    uniform_int_distribution<size_t> size_dist(2, 16);
+    uniform_int_distribution<unsigned> percent_dist(0, 99);
+    vector<object> objects;
+    size_t region = size_t(-1);
+    bool region_populated = false;
+    for (size_t w = 0; w + 16 < heap_words;) {
+      if (w / region_words != region) {
+        region = w / region_words;
+        region_populated = percent_dist(rng) < populated;
+      }
+      size_t s = size_dist(rng);
+      if (region_populated && percent_dist(rng) < live) {
+        objects.push_back({w, w + s - 1});
+      }
+      w += s;
+    }
+    shuffle(objects.begin(), objects.end(), rng);
+    return objects;
+  }
+
+  void run(bitmap_layout layout, const char *name, size_t heap_bytes,
+           const vector<object> &objects, unsigned reps) {
+    const size_t heap_words = heap_bytes >> 3;
+    double mark_ms = 0, scan_ms = 0;
+    size_t free_runs = 0;
+    for (unsigned r = 0; r < reps; r++) {
+      mark_bitmap *bitmap = new mark_bitmap(heap_bytes, layout);
+
+      auto start = clock_type::now();
+      for (const object &o : objects) {
+        if (!bitmap->is_word_marked(o.begin)) {
+          bitmap->mark_words(o.begin, o.end);
+        }
+      }
+      mark_ms += ms_since(start);
+
+      start = clock_type::now();
+      free_runs = 0;
+      size_t word = 0;
+      while (word < heap_words) {
+        word = bitmap->find_next_used_word(word, heap_words);
+        if (word >= heap_words) {
+          break;
+        }
+        bool found_set_bit = false;
+        word = bitmap->find_next_free_word(word, heap_words, found_set_bit);
+        free_runs++;
+      }
+      scan_ms += ms_since(start);
+
+      delete bitmap;
+    }
+    cout << name << ": mark " << mark_ms / reps << " ms, sweep scan "
+         << scan_ms / reps << " ms (" << free_runs << " free runs)" << endl;
+  }
+}
+
+int main(int argc, char **argv) {
+  size_t heap_mb = argc > 1 ? strtoul(argv[1], nullptr, 10) : 1024;
+  unsigned live = argc > 2 ? strtoul(argv[2], nullptr, 10) : 30;
+  unsigned reps = argc > 3 ? strtoul(argv[3], nullptr, 10) : 3;
+  unsigned populated = argc > 4 ? strtoul(argv[4], nullptr, 10) : 100;
+  size_t heap_bytes = heap_mb << 20;
+
+  mt19937_64 rng(42);
+  vector<object> objects = make_live_objects(heap_bytes >> 3, live, populated, rng);
+  cout << objects.size() << " live objects in a " << heap_mb << "MB heap" << endl;
+
+  run(bitmap_layout::separate, "separate", heap_bytes, objects, reps);
+  run(bitmap_layout::interleaved, "interleaved", heap_bytes, objects, reps);
+  return 0;
+}
@@ -53,6 +53,7 @@ void show_usage() {
              << "-s, --ctrl-size <size>\t Create a control heap of given size (in GB). Default: computed automatically.\n"
              << "-f, --heap-path <path>\t Create GC heap file at path. Default: heaps/gc_heap\n"
              << "-c, --ctrl-path <path>\t Create control heap file at path. Default: heaps/managed_heap\n"
+             << "-i, --interleaved\t Interleave the begin and end mark bitmaps.\n"
              << "-h, --help\t\t Display this message.\n";
 }
 
@@ -122,6 +123,7 @@ int main(int argc, char **argv) {
            {"ctrl-path",  required_argument, 0, 'c'},
            {"heap-path",  required_argument, 0, 'f'},
            {"ctrl-size",  required_argument, 0, 's'},
+           {"interleaved", no_argument,      0, 'i'},
            {0,            0,                 0,  0 }
     };
 
@@ -129,10 +131,11 @@ int main(int argc, char **argv) {
   std::string heap_file = "heaps/gc_heap";
 
   std::size_t ctrl_size = 0;
+  mpgc::bitmap_layout layout = mpgc::bitmap_layout::separate;
   std::size_t heap_size;
 
   while (true) {
-    int c = getopt_long(argc, argv, "hc:f:s:", long_options, nullptr);
+    int c = getopt_long(argc, argv, "hc:f:s:i", long_options, nullptr);
 
     if (c == -1) {
       break;
@@ -151,6 +154,9 @@ int main(int argc, char **argv) {
       case 's': ctrl_size = parse_mem_size(optarg);
                 break;
 
+      case 'i': layout = mpgc::bitmap_layout::interleaved;
+                break;
+
       case '?': show_usage();
                 return -1;
     }
@@ -176,7 +182,7 @@ int main(int argc, char **argv) {
   make_file(ctrl_file, ctrl_size, "Control file");
   setenv("MPGC_CONTROL_HEAP", ctrl_file.c_str(), 1);
 
-  mpgc::init_on_createheap();
+  mpgc::init_on_createheap(layout);
 
   unsetenv("MPGC_GC_HEAP");
   unsetenv("MPGC_CONTROL_HEAP");
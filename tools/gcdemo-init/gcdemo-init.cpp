@@ -172,10 +172,10 @@ populateUsers(const unsigned long numUsers, unsigned int mean, unsigned int feed
   UniformRNG namerng(names.size());
   users.reserve(numUsers);
   id_to_user.reserve(numUsers);
-  for (unsigned long i = 0; i < numUsers; i++) {
-    users[i] = make_gc<User>(feedLength, names[namerng.randElt()]);
-    id_to_user[users[i]->id] = users[i];
-  }
+  make_gc_n<User>(numUsers, [&](unsigned long i, auto &&construct) {
+      users[i] = construct(feedLength, names[namerng.randElt()]);
+      id_to_user[users[i]->id] = users[i];
+    });
   cout << "Done.\n" << flush;
 
   cout << "Generating friendships (this step might take a while)...\n" << flush;
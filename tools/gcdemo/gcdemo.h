@@ -66,6 +66,14 @@ void printMemStats() {
        << "  GC cycle number: " << to_string(ms.cycle_number()) << endl
        << "  # processes:     " << to_string(ms.n_processes()) << endl
        << "  # objects:       " << to_string(ms.n_objects()) << endl
+       << "  Last sweep:" << endl
+       << "    Free chunks:   " << to_string(ms.free_chunks_after_sweep()) << endl
+       << "    Free bytes:    " << to_string(ms.free_bytes_after_sweep()) << endl
+       << "    Largest chunk: " << to_string(ms.largest_free_chunk_bytes()) << endl
+       << "    List nodes:    " << to_string(ms.skiplist_nodes_after_sweep()) << endl
+       << "  Handshakes:      " << to_string(ms.handshake_count()) << endl
+       << "    Wait (us):     " << to_string(ms.handshake_wait_time().count() / 1000) << endl
+       << "    GC CPU (us):   " << to_string(ms.handshake_cpu_time().count() / 1000) << endl
        << endl;
 }
 